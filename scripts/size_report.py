@@ -0,0 +1,129 @@
+# PlatformIO extra script: flash/RAM size report with budgets
+#
+#   pio run -t size_report
+#
+# Prints the flash and RAM used by each source file and the largest symbols,
+# then fails the build if the totals exceed custom_flash_budget or
+# custom_ram_budget from platformio.ini.
+#
+# The build uses LTO, so the object files only hold bitcode, and most of the
+# code is in headers included from main.cpp. Sizes are therefore taken from
+# the linked ELF, with each symbol put against the file it was defined in
+# according to the debug info (nm -l).
+import os
+import subprocess
+
+Import("env")
+
+# debug info only, it lets nm find each symbol's file and leaves the image as it is
+env.Append(CCFLAGS=["-g"], LINKFLAGS=["-g"])
+
+# number of largest symbols listed for flash and for RAM
+SYMBOL_REPORT_COUNT = 20
+
+
+def tool(name):
+    # the AVR binutils sit next to the compiler
+    cc = env.subst("$CC")
+    return os.path.join(os.path.dirname(cc), os.path.basename(cc).replace("gcc", name))
+
+
+def run(args):
+    return subprocess.check_output(args, env=env["ENV"], universal_newlines=True)
+
+
+def section_sizes(path):
+    # avr-size -A prints "<section> <size> <address>" per section
+    sizes = {}
+    for line in run([tool("size"), "-A", path]).splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1].isdigit():
+            sizes[parts[0]] = sizes.get(parts[0], 0) + int(parts[1])
+    return sizes
+
+
+def flash_ram(sizes):
+    # .rodata stays in the memory mapped flash on tinyAVR, .data is stored
+    # in flash and copied to RAM at startup
+    flash = 0
+    ram = 0
+    for name, size in sizes.items():
+        if name.startswith((".text", ".rodata", ".progmem")):
+            flash += size
+        elif name.startswith(".data"):
+            flash += size
+            ram += size
+        elif name.startswith((".bss", ".noinit")):
+            ram += size
+    return flash, ram
+
+
+def budget(option):
+    value = env.GetProjectOption(option, "")
+    return int(value, 0) if value else None
+
+
+def size_report(target, source, env):
+    elf = str(source[0])
+
+    # nm -l appends "<tab>file:line" when the debug info knows where a symbol
+    # came from, the core and libc are built without it
+    symbols = []
+    files = {}
+    project_dir = env.subst("$PROJECT_DIR")
+    for line in run([tool("nm"), "-S", "-C", "-l", "--size-sort", "-r", elf]).splitlines():
+        symbol, _, location = line.partition("\t")
+        parts = symbol.split(None, 3)
+        if len(parts) != 4:
+            continue
+        size, kind, name = int(parts[1], 16), parts[2], parts[3]
+        symbols.append((size, kind, name))
+        if location:
+            path = location.rsplit(":", 1)[0]
+            if path.startswith(project_dir):
+                path = os.path.relpath(path, project_dir)
+        else:
+            path = "(core and libraries)"
+        # nm type letters: t/T text, r/R rodata go to flash, d/D data, b/B bss to RAM
+        flash, ram = files.get(path, (0, 0))
+        if kind.lower() in "trd":
+            flash += size
+        if kind.lower() in "db":
+            ram += size
+        files[path] = (flash, ram)
+
+    print("Per source file (flash / RAM bytes):")
+    for path, (flash, ram) in sorted(files.items(), key=lambda item: -item[1][0]):
+        print("  %-40s %6d %6d" % (path, flash, ram))
+
+    print("Largest flash symbols:")
+    for size, kind, name in [s for s in symbols if s[1].lower() in "trd"][:SYMBOL_REPORT_COUNT]:
+        print("  %6d %s %s" % (size, kind, name))
+    print("Largest RAM symbols:")
+    for size, kind, name in [s for s in symbols if s[1].lower() in "db"][:SYMBOL_REPORT_COUNT]:
+        print("  %6d %s %s" % (size, kind, name))
+
+    flash, ram = flash_ram(section_sizes(elf))
+    flash_budget = budget("custom_flash_budget")
+    ram_budget = budget("custom_ram_budget")
+    print("Total flash: %d / %s bytes" % (flash, flash_budget))
+    print("Total RAM:   %d / %s bytes (static, the stack uses the rest)" % (ram, ram_budget))
+
+    failed = False
+    if flash_budget is not None and flash > flash_budget:
+        print("Flash budget exceeded by %d bytes" % (flash - flash_budget))
+        failed = True
+    if ram_budget is not None and ram > ram_budget:
+        print("RAM budget exceeded by %d bytes" % (ram - ram_budget))
+        failed = True
+    if failed:
+        env.Exit(1)
+
+
+env.AddCustomTarget(
+    name="size_report",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions=size_report,
+    title="Size Report",
+    description="Flash/RAM use per source file and symbol, checked against the budgets",
+)
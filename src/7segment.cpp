@@ -1,7 +1,7 @@
 #include "7segment.h"
 #include <Arduino.h>
 
-SegmentDisplay::SegmentDisplay(int digits, polarity_t polarity)
+SegmentDisplay::SegmentDisplay(uint8_t digits, polarity_t polarity)
 {
     this->digits = digits;
     this->polarity = polarity;
@@ -74,12 +74,121 @@ void SegmentDisplay::display(const char *value, int length = MAX_DIGITS)
         length = MAX_DIGITS;
     }
     strncpy(outputBuffer, value, length);
+    dpDigit = -1;
 }
 
 void SegmentDisplay::display(const int value)
 {
-    // convert value to a string, up to MAX_DIGITS and copy to the output buffer
-    itoa(value, outputBuffer, 10);
+    // whole numbers are just fixed point values without a fraction
+    displayFixed(value, 0);
+}
+
+/***
+ * Convert a binary value (0 - 9999) to packed BCD using the double dabble
+ * (shift and add 3) algorithm, so no division is needed on the AVR
+ * Output: 4 BCD digits, most significant in the top nibble
+*/
+static uint16_t toBcd(uint16_t value)
+{
+    uint16_t bcd = 0;
+    for (int8_t bit = 13; bit >= 0; bit--)
+    {
+        // any nibble of 5 or more would overflow past 9 when doubled
+        if ((bcd & 0x000F) >= 0x0005) bcd += 0x0003;
+        if ((bcd & 0x00F0) >= 0x0050) bcd += 0x0030;
+        if ((bcd & 0x0F00) >= 0x0500) bcd += 0x0300;
+        if ((bcd & 0xF000) >= 0x5000) bcd += 0x3000;
+        bcd = (bcd << 1) | ((value >> bit) & 1);
+    }
+    return bcd;
+}
+
+/***
+ * Render a fixed point value right aligned on the display
+ * Input: value - the value multiplied by 2^fractionBits
+ *        fractionBits - number of fractional bits in value (0 for whole numbers)
+ * One decimal place is shown (using the decimal point) when there is room for it,
+ * otherwise the value is rounded to a whole number. Values that don't fit show
+ * "hi" or "lo".
+ * Output: true if the displayed glyphs changed
+*/
+bool SegmentDisplay::displayFixed(long value, uint8_t fractionBits)
+{
+    char glyphs[MAX_DIGITS];
+    int8_t newDp = -1;
+    bool negative = value < 0;
+    unsigned long magnitude = negative ? -value : value;
+
+    // split into whole and tenths, rounding the fraction to the nearest tenth
+    unsigned long whole = magnitude >> fractionBits;
+    uint8_t tenths = 0;
+    if (fractionBits > 0)
+    {
+        unsigned long fraction = magnitude & ((1UL << fractionBits) - 1);
+        tenths = (fraction * 10 + (1UL << (fractionBits - 1))) >> fractionBits;
+        if (tenths >= 10)
+        {
+            whole++;
+            tenths = 0;
+        }
+    }
+
+    // count the digits in the whole part without dividing
+    uint8_t wholeDigits = whole >= 1000 ? 4 : whole >= 100 ? 3 : whole >= 10 ? 2 : 1;
+    uint8_t available = digits - (negative ? 1 : 0);
+    bool showTenths = fractionBits > 0 && wholeDigits < available;
+    if (!showTenths && tenths >= 5)
+    {
+        whole++;
+        wholeDigits = whole >= 1000 ? 4 : whole >= 100 ? 3 : whole >= 10 ? 2 : 1;
+    }
+
+    // a value that rounds to zero has no sign
+    if (whole == 0 && (!showTenths || tenths == 0))
+    {
+        negative = false;
+    }
+
+    for (int i = 0; i < MAX_DIGITS; i++)
+    {
+        glyphs[i] = ' ';
+    }
+
+    if (whole > 9999 || wholeDigits > available)
+    {
+        // too big to show, fall back to the overflow markers
+        glyphs[digits - 2] = negative ? 'l' : 'h';
+        glyphs[digits - 1] = negative ? 'o' : 'i';
+    }
+    else
+    {
+        // fill the digits in from the right hand side
+        uint16_t bcd = toBcd(whole);
+        int8_t position = digits - 1;
+        if (showTenths)
+        {
+            glyphs[position--] = '0' + tenths;
+            newDp = position;
+        }
+        for (uint8_t i = 0; i < wholeDigits; i++)
+        {
+            glyphs[position--] = '0' + (bcd & 0x0F);
+            bcd >>= 4;
+        }
+        if (negative)
+        {
+            glyphs[position] = '-';
+        }
+    }
+
+    // only touch the output buffer if something visible has changed
+    if (newDp == dpDigit && memcmp(glyphs, outputBuffer, MAX_DIGITS) == 0)
+    {
+        return false;
+    }
+    memcpy(outputBuffer, glyphs, MAX_DIGITS);
+    dpDigit = newDp;
+    return true;
 }
 
 void SegmentDisplay::next()
@@ -88,13 +197,14 @@ void SegmentDisplay::next()
     
     // get the index of the next digit in the symbol lookup table
     int index = 0;
-    while (symbolLookup[index] != outputBuffer[current_digit] && index < SYMBOL_COUNT)
+    while (index < SYMBOL_COUNT && symbolLookup[index] != outputBuffer[current_digit])
     {
         index++;
     }
     
     if(index >= SYMBOL_COUNT){
-        index = SYMBOL_COUNT;
+        // unknown characters show as blank
+        index = SYMBOL_COUNT - 1;
     }
 
     // output the current symbol to the display
@@ -111,8 +221,8 @@ void SegmentDisplay::next()
         }
     }
 
-    // if this is the final digit and the dp bit is set, turn on the decimal point
-    if (current_digit == digits - 1 && dp)
+    // if this is the digit holding the decimal point, turn it on
+    if (current_digit == dpDigit)
     {
         if(polarity == COMMON_CATHODE_INV_DIGIT || polarity == COMMON_CATHODE){
             SET_BY_MASK(PORTA.OUT, segments[SEG_DP].portA);
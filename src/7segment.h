@@ -61,15 +61,15 @@ const segmentBitmask digitPins[MAX_DIGITS] = {
 #define SEG_G 6
 #define SEG_DP 7
 
-#define SYMBOL_COUNT 20
+#define SYMBOL_COUNT 22
 const char symbolLookup[SYMBOL_COUNT] = {
     '0', '1', '2', '3', '4', '5', '6', '7',
-    '8', '9', 'a', 'b', 'c', 'd', 'e', 'f', 'h', 'i', '-', ' '
+    '8', '9', 'a', 'b', 'c', 'd', 'e', 'f', 'h', 'i', 'l', 'o', '-', ' '
 };
 
 struct symbol{
-    int count;
-    char segments[SEGMENT_COUNT];
+    uint8_t count;
+    uint8_t segments[SEGMENT_COUNT];
 };
 
 // Define the segments that need to be turned on for each symbol
@@ -93,11 +93,13 @@ const symbol symbols[SYMBOL_COUNT] = {
     {4, {SEG_A, SEG_E, SEG_F, SEG_G}},  // f
     {4, {SEG_C, SEG_E, SEG_F, SEG_G}},    // h
     {1, {SEG_C}},  // i
+    {3, {SEG_D, SEG_E, SEG_F}},  // l
+    {4, {SEG_C, SEG_D, SEG_E, SEG_G}},  // o
     {1, {SEG_G}},  // -
     {0, {}} // blank
 };
 
-enum polarity_t{
+enum polarity_t : uint8_t{
     COMMON_ANODE,  // Common anodes light up on an output 0, with the digit being 1
     COMMON_CATHODE, // Common cathodes light up on an output 1, with the digit being 0
     COMMON_ANODE_INV_DIGIT, // Common anodes light up on an output 0, with the digit being 0
@@ -109,24 +111,25 @@ enum polarity_t{
 
 class SegmentDisplay{
     public:
-        SegmentDisplay(int digits, polarity_t polarity);
+        SegmentDisplay(uint8_t digits, polarity_t polarity);
         void begin();
         void display(const char *value, int len = MAX_DIGITS);
         void display(const int value);
+        bool displayFixed(long value, uint8_t fractionBits);
         void clear(){for (int i = 0; i < MAX_DIGITS; i++) outputBuffer[i] = ' ';};
         void next();
         void test();
-        void setDp(bool state){dp = state;};
+        void setDp(bool state){dpDigit = state ? digits - 1 : -1;};
         void blankDisplay(); // turns off the display
     private:
         segmentBitmask allSegments;
         segmentBitmask allDigits;
         char outputBuffer[MAX_DIGITS];
         polarity_t polarity = COMMON_CATHODE;
-        int digits = 0;
-        int current_digit = 0;
-        int counter = 0;
-        bool dp = false;
+        uint8_t digits = 0;
+        uint8_t current_digit = 0;
+        uint8_t counter = 0;
+        int8_t dpDigit = -1; // digit that shows the decimal point, -1 for none
 };
 
 
@@ -2,11 +2,13 @@
 #define _CALIBRATION_H_
 #include <Arduino.h>
 #include <EEPROM.h>
+#include "format.h"
+#include "trace.h"
 
 #define SENSOR_AMBIENT 0
 #define SENSOR_HEATER  1
-int tCalibration = 0; // used only for one-point calibration
-const int tempMultiplyFactor = 8;
+const int tempFractionBits = 3; // temperatures are stored in 1/8 C
+const int tempMultiplyFactor = 1 << tempFractionBits;
 
 
 // structure to hold calibration data
@@ -25,19 +27,21 @@ struct calibrationData calibration[2] = {
 };
 
 // from https://docs.arduino.cc/learn/programming/eeprom-guide/
-unsigned long eeprom_crc(void) {
-  const unsigned long crc_table[16] = {
-    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
-    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
-    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
-    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
-  };
+// a global const table stays in flash, rather than being copied onto the stack on every call
+const unsigned long crc_table[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+  0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+  0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
 
+unsigned long eeprom_crc(void) {
   unsigned long crc = ~0L;
   int16_t eepromSize = EEPROM.length() - sizeof(unsigned long);
   for (int index = 0 ; index < eepromSize  ; ++index) {
-    crc = crc_table[(crc ^ EEPROM[index]) & 0x0f] ^ (crc >> 4);
-    crc = crc_table[(crc ^ (EEPROM[index] >> 4)) & 0x0f] ^ (crc >> 4);
+    uint8_t value = EEPROM[index];
+    crc = crc_table[(crc ^ value) & 0x0f] ^ (crc >> 4);
+    crc = crc_table[(crc ^ (value >> 4)) & 0x0f] ^ (crc >> 4);
     crc = ~crc;
   }
   return crc;
@@ -51,34 +55,48 @@ bool checkEepromCrc(){
 }
 
 void wipeEeprom(){
+    trace(TRACE_EEPROM_WRITE, 1);
     for(int i = 0; i < EEPROM.length(); i++){
         EEPROM.write(i, 0);
     }
 }
 
-void writeCal(){
+// recompute the stored CRC after changing anything in the EEPROM
+void writeEepromCrc(){
+    unsigned long crc = eeprom_crc();
+    EEPROM.put(EEPROM.length() - sizeof(unsigned long), crc);
+}
+
+// save the calibration without reporting it, for the register protocol
+void storeCal(){
+    trace(TRACE_EEPROM_WRITE, 0);
     for(int i = 0; i < 2; i++){
         EEPROM.put(i * sizeof(calibrationData), calibration[i]);
     }
-    unsigned long crc = eeprom_crc();
-    EEPROM.put(EEPROM.length() - sizeof(unsigned long), crc);
+    writeEepromCrc();
+}
+
+void writeCal(){
+    storeCal();
     Serial.println(F("Calibration data written to EEPROM"));
 }
 
 void printCalibration(){
     for(int i = 0; i < 2; i++){
-        Serial.print(F("Sensor "));
-        Serial.print(i == SENSOR_AMBIENT ? F("Ambient") : F("Heater"));
-        Serial.print(F(" Low: "));
-        Serial.print(calibration[i].tempLow / tempMultiplyFactor);
-        Serial.print(F(" High: "));
-        Serial.print(calibration[i].tempHigh / tempMultiplyFactor);
-        Serial.print(F(" Low ADC: "));
-        Serial.print(calibration[i].adcLow);
-        Serial.print(F(" High ADC: "));
-        Serial.print(calibration[i].adcHigh);
-        Serial.print(F(" Offset: "));
-        Serial.println(calibration[i].offset);
+        LineBuilder line;
+        line.text(F("Sensor "));
+        line.text(i == SENSOR_AMBIENT ? F("Ambient") : F("Heater"));
+        line.text(F(" Low: "));
+        line.fixed(calibration[i].tempLow, tempFractionBits);
+        line.text(F(" High: "));
+        line.fixed(calibration[i].tempHigh, tempFractionBits);
+        line.text(F(" Low ADC: "));
+        line.number(calibration[i].adcLow);
+        line.text(F(" High ADC: "));
+        line.number(calibration[i].adcHigh);
+        line.text(F(" Offset: "));
+        line.fixed(calibration[i].offset, tempFractionBits);
+        line.send();
     }
 
 }
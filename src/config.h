@@ -1,11 +1,43 @@
 #pragma once
+#include <Arduino.h>
 
 // Globals
 extern bool verbose = false; 
 extern long targetTemp = 35;
 extern bool running = true;
+bool cascadeControl = false; // use the heater sensor as an inner control loop
+
+// target temperature limits, C
+#define MAX_TEMP 50
+#define MIN_TEMP 0
+
+// Register protocol slave address, 1 - 31 but not 8, 10 or 13, so it can't be
+// mistaken for text
+const uint8_t modbusAddress = 1;
+bool modbusActive = false; // a register master is polling, hold back unsolicited text
 
 // Pin definitions
 const int tempPinAmbient = 14;
 const int tempPinHeater = 15;
-const int heaterOutput = 16;
\ No newline at end of file
+const int heaterOutput = 16;
+
+// Heater zones
+// Zone 0 is the ambient sensor and heaterOutput above, extra zones have their
+// own sensor (read with the ambient calibration) and output. With more than one
+// zone the outputs are scheduled so the heaters never draw more than
+// zoneCurrentBudget at once, e.g. for three 24V 1A elements on a 2A supply:
+//     #define HEATER_ZONES 3
+//     {tempPinAmbient, heaterOutput, 1000, 24}, {12, 13, 1000, 24}, {10, 11, 1000, 24}
+//     const uint16_t zoneCurrentBudget = 2000;
+struct zoneConfig{
+    uint8_t sensorPin;
+    uint8_t outputPin;
+    uint16_t current; // mA drawn by the heater element
+    uint16_t watts;   // heater element power, used for the energy meter
+};
+
+#define HEATER_ZONES 1
+const zoneConfig zoneConfigs[HEATER_ZONES] = {
+    {tempPinAmbient, heaterOutput, 1000, 24}
+};
+const uint16_t zoneCurrentBudget = 1000; // mA available for all heaters together
\ No newline at end of file
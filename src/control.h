@@ -0,0 +1,121 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include "config.h"
+#include <Arduino.h>
+#include "calibration.h"
+#include "temperature.h"
+#include "format.h"
+#include "trace.h"
+#include "energy.h"
+
+/*
+    Cascade control
+    The outer loop runs on the ambient sensor and turns the ambient error into
+    a setpoint for the heater surface. The inner loop runs several times faster
+    on the heater sensor and switches the heater to hold that setpoint, so
+    changes at the heater are corrected before they reach the enclosure air.
+    All temperatures are in C multiplied by tempMultiplyFactor.
+*/
+
+const unsigned long cascadeInnerPeriod = 200; // ms between inner loop steps
+const uint8_t cascadeInnerSteps = 5;           // inner loop steps per outer loop step
+const long cascadeGain = 4;                    // heater setpoint change per degree of ambient error
+const long cascadeIntegralShift = 4;           // integral term is the summed error divided by 16
+const long heaterSetpointMargin = 5;           // keep the heater setpoint this far below maxHeaterTemp (C)
+const long heaterHysteresis = tempMultiplyFactor / 2; // inner loop switching band, +/- 0.5C
+
+long heaterSetpoint = 0;
+long cascadeIntegral = 0;
+uint8_t cascadeStep = 0; // inner loop steps since the last outer step
+bool heaterOn[HEATER_ZONES]; // output state of each zone's heater
+
+/***
+ * Switch a zone's heater, tracing the reason whenever its state changes
+ * Input: zone - the zone, 0 is heaterOutput
+ *        on - the new heater state
+ *        reason - the traceReason for the decision
+ *        temperature - the reading that caused it
+*/
+void setZoneHeater(uint8_t zone, bool on, uint8_t reason, long temperature){
+    if (on != heaterOn[zone]){
+        trace(on ? TRACE_HEATER_ON : TRACE_HEATER_OFF, (zone << 8) | reason, temperature);
+        heaterOn[zone] = on;
+    }
+    digitalWrite(zoneConfigs[zone].outputPin, on ? HIGH : LOW);
+    meterSwitch(zone, on);
+}
+
+// switch the main heater (zone 0)
+void setHeater(bool on, uint8_t reason, long temperature){
+    setZoneHeater(0, on, reason, temperature);
+}
+
+// cut the heater if it is over maxHeaterTemp, returns true if it was cut
+bool checkHeaterLimit(long tempHeater){
+    if (tempHeater <= maxHeaterTemp * tempMultiplyFactor){
+        return false;
+    }
+    setHeater(false, REASON_HEATER_LIMIT, tempHeater);
+    traceFault(REASON_HEATER_LIMIT, tempHeater);
+    return true;
+}
+
+// restart the cascade, the next step is an outer step so the setpoint is
+// worked out before the inner loop uses it
+void resetCascade(){
+    heaterSetpoint = 0;
+    cascadeIntegral = 0;
+    cascadeStep = 0;
+}
+
+/***
+ * Outer loop step, call once per ambient reading
+ * Input: tempAmbient - the ambient temperature
+ * Output: the new heater surface setpoint
+*/
+long updateHeaterSetpoint(long tempAmbient){
+    const long maxSetpoint = (maxHeaterTemp - heaterSetpointMargin) * tempMultiplyFactor;
+    long target = targetTemp * tempMultiplyFactor;
+    long error = target - tempAmbient;
+
+    long setpoint = target + error * cascadeGain + (cascadeIntegral >> cascadeIntegralShift);
+
+    // only integrate while the setpoint isn't pinned against a limit, so the
+    // integral doesn't wind up while the heater can't do any more
+    if (setpoint > maxSetpoint){
+        setpoint = maxSetpoint;
+        if (error < 0) cascadeIntegral += error;
+    } else if (setpoint < 0){
+        setpoint = 0;
+        if (error > 0) cascadeIntegral += error;
+    } else {
+        cascadeIntegral += error;
+    }
+
+    heaterSetpoint = setpoint;
+    trace(TRACE_SETPOINT, heaterSetpoint, constrain(cascadeIntegral, -32768L, 32767L));
+    if(verbose && !modbusActive){
+        LineBuilder line;
+        line.text(F("Heater setpoint: "));
+        line.fixed(heaterSetpoint, tempFractionBits);
+        line.text(F("C, Integral: "));
+        line.number(cascadeIntegral);
+        line.send();
+    }
+    return heaterSetpoint;
+}
+
+/***
+ * Inner loop step, switches the heater to hold the heater setpoint
+ * Input: tempHeater - the heater temperature
+*/
+void updateHeaterOutput(long tempHeater){
+    if (tempHeater < heaterSetpoint - heaterHysteresis){
+        setHeater(true, REASON_CASCADE, tempHeater);
+    } else if (tempHeater > heaterSetpoint + heaterHysteresis){
+        setHeater(false, REASON_CASCADE, tempHeater);
+    }
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef _ENERGY_H_
+#define _ENERGY_H_
+
+#include "config.h"
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "calibration.h"
+#include "format.h"
+#include "trace.h"
+
+/*
+    Heater energy meter
+    Every heater output change is timestamped with millis(), so on-time is
+    counted to the millisecond and turned into energy with the element's
+    rated watts from zoneConfigs. The energy is binned into 5 second buckets
+    that feed rolling 1 minute, 1 hour and 24 hour windows. A lifetime total
+    is saved to the EEPROM every 6 hours, which keeps the wear down.
+*/
+
+#define EEPROM_METER_ADDR 32           // after the calibration data
+const unsigned long meterBucketPeriod = 5000; // ms per bucket
+#define METER_MINUTE_BUCKETS 12        // 5 second buckets
+#define METER_HOUR_BUCKETS 12          // 5 minute buckets
+#define METER_DAY_BUCKETS 24           // 1 hour buckets
+#define METER_SAVE_HOURS 6
+
+// lifetime totals, as stored in the EEPROM
+struct meterTotals{
+    uint32_t wattHours;
+    uint16_t joules;    // part of a watt hour, under 3600
+    uint32_t onSeconds; // summed over all zones
+};
+
+// ring of energy buckets, the sum covers the last SIZE buckets
+template <typename T, uint8_t SIZE>
+struct energyWindow{
+    T buckets[SIZE];
+    uint8_t next;
+    uint8_t filled;
+    uint32_t sum;
+
+    void push(T joules){
+        if (filled == SIZE){
+            sum -= buckets[next];
+        } else {
+            filled++;
+        }
+        buckets[next] = joules;
+        sum += joules;
+        next = (next + 1) % SIZE;
+    }
+};
+
+meterTotals lifetime;
+energyWindow<uint16_t, METER_MINUTE_BUCKETS> minuteWindow;
+energyWindow<uint32_t, METER_HOUR_BUCKETS> hourWindow;
+energyWindow<uint32_t, METER_DAY_BUCKETS> dayWindow;
+
+bool meterOn[HEATER_ZONES];
+uint32_t meterSince[HEATER_ZONES];
+uint32_t meterPending = 0;   // watt milliseconds not yet in a bucket
+uint32_t meterOnMs = 0;      // on-time not yet in lifetime.onSeconds
+uint32_t meterBucketStart = 0;
+uint32_t meterFiveMinutes = 0; // joules in the 5 minute bucket being filled
+uint32_t meterHour = 0;        // joules in the hour bucket being filled
+uint8_t meterBucketCount = 0;  // 5 second buckets in meterFiveMinutes
+uint8_t meterFiveMinuteCount = 0;
+uint8_t meterHourCount = 0;    // hours since the lifetime total was saved
+
+// add the on-time since the last fold to the pending energy
+void meterFold(uint8_t zone, uint32_t now){
+    uint32_t ms = now - meterSince[zone];
+    meterPending += ms * zoneConfigs[zone].watts;
+    meterOnMs += ms;
+    meterSince[zone] = now;
+}
+
+// call whenever a heater output is switched
+void meterSwitch(uint8_t zone, bool on){
+    if (on == meterOn[zone]) return;
+    uint32_t now = millis();
+    if (on){
+        meterSince[zone] = now;
+    } else {
+        meterFold(zone, now);
+    }
+    meterOn[zone] = on;
+}
+
+void loadMeter(){
+    EEPROM.get(EEPROM_METER_ADDR, lifetime);
+}
+
+void saveMeter(){
+    trace(TRACE_EEPROM_WRITE, 2);
+    EEPROM.put(EEPROM_METER_ADDR, lifetime);
+    writeEepromCrc();
+}
+
+// close the 5 second bucket, call from the loop
+// returns true when a bucket was closed and the lifetime totals changed
+bool updateMeter(){
+    uint32_t now = millis();
+    if (now - meterBucketStart < meterBucketPeriod) return false;
+    meterBucketStart += meterBucketPeriod;
+
+    for (uint8_t z = 0; z < HEATER_ZONES; z++){
+        if (meterOn[z]) meterFold(z, now);
+    }
+
+    // whole joules go in the bucket, the rest waits for the next one
+    uint16_t joules = meterPending / 1000;
+    meterPending -= joules * 1000UL;
+    minuteWindow.push(joules);
+
+    lifetime.joules += joules;
+    while (lifetime.joules >= 3600){
+        lifetime.joules -= 3600;
+        lifetime.wattHours++;
+    }
+    uint32_t seconds = meterOnMs / 1000;
+    meterOnMs -= seconds * 1000;
+    lifetime.onSeconds += seconds;
+
+    meterFiveMinutes += joules;
+    if (++meterBucketCount < 60) return true;
+    meterBucketCount = 0;
+    hourWindow.push(meterFiveMinutes);
+    meterHour += meterFiveMinutes;
+    meterFiveMinutes = 0;
+
+    if (++meterFiveMinuteCount < 12) return true;
+    meterFiveMinuteCount = 0;
+    dayWindow.push(meterHour);
+    meterHour = 0;
+
+    if (++meterHourCount >= METER_SAVE_HOURS){
+        meterHourCount = 0;
+        saveMeter();
+    }
+    return true;
+}
+
+/***
+ * Duty cycle of all the heaters together over a window
+ * Input: joules - energy used in the window
+ *        seconds - length of the window
+ * Output: duty in 0.1% units
+*/
+uint16_t windowDuty(uint32_t joules, uint32_t seconds){
+    uint32_t installed = 0;
+    for (uint8_t z = 0; z < HEATER_ZONES; z++){
+        installed += zoneConfigs[z].watts;
+    }
+    // scaled so it stays in 32 bits for big windows
+    uint32_t possible = installed * seconds;
+    uint32_t duty = 0;
+    if (possible >= 1000 && joules > 4000000UL){
+        duty = joules / (possible / 1000);
+    } else if (possible > 0){
+        duty = joules * 1000 / possible;
+    }
+    return duty;
+}
+
+/***
+ * Print one rolling window as energy and duty
+ * Input: joules - energy in the window
+ *        seconds - time the window covers so far
+ * Duty is the energy as a share of what every heater on full would use
+*/
+void printWindow(LineBuilder *line, uint32_t joules, uint32_t seconds){
+    line->decimal(joules / 360, 1); // 0.1 Wh units
+    line->text(F("Wh, "));
+    line->decimal(windowDuty(joules, seconds), 1);
+    line->character('%');
+}
+
+void printEnergy(){
+    LineBuilder line;
+    line.text(F("Lifetime: "));
+    line.decimal(lifetime.wattHours * 10 + lifetime.joules / 360, 1);
+    line.text(F("Wh, on for "));
+    line.decimal(lifetime.onSeconds / 360, 1);
+    line.character('h');
+    line.send();
+
+    line.text(F("1 min: "));
+    printWindow(&line, minuteWindow.sum, minuteWindow.filled * (meterBucketPeriod / 1000));
+    line.send();
+    line.text(F("1 hour: "));
+    printWindow(&line, hourWindow.sum, hourWindow.filled * 300UL);
+    line.send();
+    line.text(F("24 hours: "));
+    printWindow(&line, dayWindow.sum, dayWindow.filled * 3600UL);
+    line.send();
+}
+
+#endif
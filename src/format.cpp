@@ -0,0 +1,138 @@
+#include "format.h"
+#include <Arduino.h>
+
+// powers of ten for converting numbers without dividing, .rodata stays in
+// the memory mapped flash on tinyAVR so a plain const table costs no RAM
+const uint32_t powersOfTen[] = {
+    1000000000, 100000000, 10000000, 1000000, 100000,
+    10000, 1000, 100, 10, 1
+};
+#define POWERS_OF_TEN_COUNT 10
+
+// leave room for the line ending
+#define LINE_CONTENT_SIZE (LINE_BUFFER_SIZE - 2)
+
+void LineBuilder::character(char c)
+{
+    if (length < LINE_CONTENT_SIZE)
+    {
+        buffer[length++] = c;
+    }
+}
+
+void LineBuilder::text(const __FlashStringHelper *value)
+{
+    // labels live in flash, so copy them out a byte at a time
+    PGM_P p = reinterpret_cast<PGM_P>(value);
+    char c;
+    while ((c = pgm_read_byte(p++)) != 0)
+    {
+        character(c);
+    }
+}
+
+void LineBuilder::text(const char *value)
+{
+    while (*value)
+    {
+        character(*value++);
+    }
+}
+
+/***
+ * Append an unsigned value
+ * Input: value - the value to print
+ *        places - digits to put after a decimal point (0 for none)
+*/
+void LineBuilder::digits(uint32_t value, uint8_t places)
+{
+    bool leading = true;
+    for (int i = 0; i < POWERS_OF_TEN_COUNT; i++)
+    {
+        uint32_t power = powersOfTen[i];
+        char digit = '0';
+        while (value >= power)
+        {
+            value -= power;
+            digit++;
+        }
+        // skip leading zeros, but always print the digit before the decimal point
+        if (digit != '0' || !leading || i >= POWERS_OF_TEN_COUNT - 1 - places)
+        {
+            if (places > 0 && i == POWERS_OF_TEN_COUNT - places)
+            {
+                character('.');
+            }
+            character(digit);
+            leading = false;
+        }
+    }
+}
+
+void LineBuilder::number(long value)
+{
+    decimal(value, 0);
+}
+
+// append a value with places digits after the decimal point, e.g. 1234, 2 -> 12.34
+void LineBuilder::decimal(long value, uint8_t places)
+{
+    if (value < 0)
+    {
+        character('-');
+        digits(-(uint32_t)value, places);
+    }
+    else
+    {
+        digits(value, places);
+    }
+}
+
+/***
+ * Append a fixed point value with all of its fractional digits
+ * Input: value - the value multiplied by 2^fractionBits
+ *        fractionBits - number of fractional bits in value
+ * Each fractional bit needs one decimal digit, so e.g. 1/8 C prints exactly as .125
+*/
+void LineBuilder::fixed(long value, uint8_t fractionBits)
+{
+    uint32_t magnitude = value;
+    if (value < 0)
+    {
+        character('-');
+        magnitude = -(uint32_t)value;
+    }
+    digits(magnitude >> fractionBits, 0);
+    if (fractionBits == 0)
+    {
+        return;
+    }
+
+    character('.');
+    uint32_t mask = (1UL << fractionBits) - 1;
+    uint32_t fraction = magnitude & mask;
+    for (uint8_t i = 0; i < fractionBits; i++)
+    {
+        fraction *= 10;
+        character('0' + (fraction >> fractionBits));
+        fraction &= mask;
+    }
+}
+
+// two hex digits, upper case
+void LineBuilder::hex(uint8_t value)
+{
+    uint8_t high = value >> 4;
+    uint8_t low = value & 0x0F;
+    character(high < 10 ? '0' + high : 'A' + high - 10);
+    character(low < 10 ? '0' + low : 'A' + low - 10);
+}
+
+void LineBuilder::send()
+{
+    // the line ending always fits, as character() keeps space for it
+    buffer[length++] = '\r';
+    buffer[length++] = '\n';
+    Serial.write((const uint8_t *)buffer, length);
+    length = 0;
+}
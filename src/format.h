@@ -0,0 +1,30 @@
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+#include <Arduino.h>
+
+#define LINE_BUFFER_SIZE 96
+
+/*
+    Builds a single line of serial output on the stack and sends it with one
+    Serial.write(), instead of a string of separate print calls.
+    Numbers are converted by subtracting powers of ten, so nothing divides.
+    Text that doesn't fit in the buffer is dropped from the end of the line.
+*/
+class LineBuilder{
+    public:
+        LineBuilder(){length = 0;};
+        void text(const __FlashStringHelper *value);
+        void text(const char *value);
+        void character(char c);
+        void number(long value);
+        void decimal(long value, uint8_t places);
+        void fixed(long value, uint8_t fractionBits);
+        void hex(uint8_t value);
+        void send();
+    private:
+        void digits(uint32_t value, uint8_t places);
+        char buffer[LINE_BUFFER_SIZE];
+        uint8_t length;
+};
+
+#endif
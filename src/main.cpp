@@ -3,6 +3,9 @@
 #include "calibration.h"
 #include "serial.h"
 #include "temperature.h"
+#include "control.h"
+#include "zones.h"
+#include "warmstart.h"
 #include "7segment.h"
 #include <avr/sleep.h>
 
@@ -38,6 +41,7 @@ void printPortDriection(){
 }
 
 SegmentDisplay display(2, COMMON_ANODE_INV_DIGIT);
+bool warmStart = false;
 
 void printMask(uint8_t mask){
   for(int i = 0; i < 8; i++){
@@ -47,6 +51,14 @@ void printMask(uint8_t mask){
 }
 
 void setup() {
+  // megaTinyCore (2.3.0 on, no bootloader) reads and clears the reset cause
+  // before setup() and leaves it in GPIOR0. RSTFR is still read in case an
+  // older core left it, and cleared by writing the flags back
+  uint8_t resetFlags = GPIOR0 | RSTCTRL.RSTFR;
+  RSTCTRL.RSTFR = resetFlags;
+  setupWatchdog();
+  setupTrace(resetFlags);
+
   // initialize digital pin LED_BUILTIN as an output.
   pinMode(LED_BUILTIN, OUTPUT);
   pinMode(heaterOutput, OUTPUT);
@@ -54,9 +66,23 @@ void setup() {
   sleep_enable();
   set_sleep_mode (SLEEP_MODE_IDLE); 
   setupSerial();
-  Serial.println(F("Starting up"));
   setupAdc();
-  getCalibration();
+  setupZones();
+  warmStart = restoreWarmState(resetFlags);
+  traceReset(resetFlags, warmStart);
+  if (resetFlags & RSTCTRL_WDRF_bm){
+    Serial.println(F("Watchdog reset, trace frozen"));
+  }
+  if (warmStart){
+    // RAM survived the reset, so skip the EEPROM scan, the warm copy of the
+    // meter totals is refreshed every bucket so it is never behind the EEPROM
+    Serial.println(F("Warm restart"));
+  } else {
+    Serial.println(F("Starting up"));
+    getCalibration();
+    loadMeter();
+  }
+  saveWarmState();
   display.begin();
   Serial.println(F("Setup complete"));
 
@@ -66,24 +92,57 @@ void setup() {
 
 // the loop function runs over and over again forever
 void loop() {
-  static uint32_t nextWakeUp = millis() + 5000;
+  // a warm restart resumes control straight away
+  static uint32_t nextWakeUp = millis() + (warmStart ? 0 : 5000);
   static uint16_t counter = 0;
   static int oldAmbient = 0;
   static int oldHeater = 0;
 
-  // Check the serial
-  handleSerial();
+  wdt_reset();
+  traceHeartbeat();
+  // keep the warm copy of the lifetime totals current, or a reset loses them
+  if (updateMeter()){
+    saveWarmState();
+  }
+
+  // Check the serial, commands may have changed the state we keep for a warm restart
+  if (handleSerial()){
+    saveWarmState();
+  }
   display.next();
   if (!running){
     display.display("--", 2);
-    digitalWrite(heaterOutput, LOW);
+    setHeater(false, REASON_STOPPED, 0);
+    if (HEATER_ZONES > 1){
+      zonesOff(REASON_STOPPED);
+      zoneSlot = ZONE_SLOTS - 1;
+    }
+    resetCascade();
   }
   if(!running || millis() < nextWakeUp){
     zzz();
     return;
   }
 
-  nextWakeUp = millis() + 1000;
+  // in cascade mode the heater is checked every inner step, and the ambient
+  // temperature once every cascadeInnerSteps
+  bool outerStep = true;
+  if (HEATER_ZONES > 1){
+    // zone outputs change every slot, the temperatures are read once a frame
+    nextWakeUp = millis() + zoneSlotPeriod;
+    if (!nextZoneSlot()){
+      return;
+    }
+  } else if (cascadeControl){
+    nextWakeUp = millis() + cascadeInnerPeriod;
+    outerStep = cascadeStep == 0;
+    cascadeStep++;
+    if (cascadeStep >= cascadeInnerSteps){
+      cascadeStep = 0;
+    }
+  } else {
+    nextWakeUp = millis() + 1000;
+  }
   // counter++;
   // digitalWrite(LED_BUILTIN, counter & 1);
   // display.display(counter);
@@ -95,27 +154,42 @@ void loop() {
   digitalWrite(LED_BUILTIN, HIGH);  
 
   // Read the temperature from the sensors
-  long tempAmbient = readTemp(SENSOR_AMBIENT);
   long tempHeater = readTemp(SENSOR_HEATER);
+  if (!outerStep){
+    // inner loop only
+    if (!checkHeaterLimit(tempHeater)){
+      updateHeaterOutput(tempHeater);
+    }
+    digitalWrite(LED_BUILTIN, LOW);
+    return;
+  }
+  long tempAmbient = readTemp(SENSOR_AMBIENT);
+  trace(TRACE_SAMPLE, tempAmbient, tempHeater);
 
-  if (verbose || tempAmbient != oldAmbient || tempHeater != oldHeater){
+  // a register master polls the readings, printing them would garble its replies
+  if (!modbusActive && (verbose || tempAmbient != oldAmbient || tempHeater != oldHeater)){
     printTemps(tempAmbient, tempHeater);
     oldAmbient = tempAmbient;
     oldHeater = tempHeater;
-    if (tempAmbient > 99 * tempMultiplyFactor){
-      display.display("hi");
-    } else {
-      display.display(int(tempAmbient / tempMultiplyFactor));
-    }
   }
+  // the display only changes when the rendered glyphs do
+  display.displayFixed(tempAmbient, tempFractionBits);
 
   // turn on the heater if needed
-  if (tempHeater > maxHeaterTemp * tempMultiplyFactor){
-    digitalWrite(heaterOutput, LOW);
+  if (checkHeaterLimit(tempHeater)){
+    // heater cut, nothing else to decide
+    if (HEATER_ZONES > 1) zonesOff(REASON_HEATER_LIMIT);
+  } else if (HEATER_ZONES > 1){
+    updateZones(tempAmbient);
+    saveWarmState();
+  } else if (cascadeControl){
+    updateHeaterSetpoint(tempAmbient);
+    updateHeaterOutput(tempHeater);
+    saveWarmState();
   } else if (tempAmbient < targetTemp * tempMultiplyFactor - tempHysteresis * tempMultiplyFactor){
-    digitalWrite(heaterOutput, HIGH);
+    setHeater(true, REASON_HYSTERESIS, tempAmbient);
   } else if (tempAmbient > targetTemp * tempMultiplyFactor + tempHysteresis * tempMultiplyFactor){
-    digitalWrite(heaterOutput, LOW);
+    setHeater(false, REASON_HYSTERESIS, tempAmbient);
   }
 
   digitalWrite(LED_BUILTIN, LOW);
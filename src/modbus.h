@@ -0,0 +1,354 @@
+#ifndef _MODBUS_H_
+#define _MODBUS_H_
+
+#include "config.h"
+#include <Arduino.h>
+#include <util/crc16.h>
+#include "calibration.h"
+#include "temperature.h"
+#include "control.h"
+#include "energy.h"
+#include "trace.h"
+
+/*
+    Register protocol
+    Modbus RTU frames on the console UART, so a PLC or script can poll the
+    controller without parsing text: address, function, data, then a CRC-16
+    sent low byte first. A frame starts with modbusAddress (or 0 to broadcast
+    a write), which can't be typed at the console, so the text commands keep
+    working on the same port. A frame ends when its length is complete, and a
+    partial frame is dropped after modbusFrameTimeout of silence. Frames for
+    other addresses from 1 to 31, with a bad CRC or with other function codes
+    get no reply, and everything up to the next gap is skipped with them, so
+    another slave's reply doesn't reach the console either. Slaves at
+    addresses of 32 or more look like text, so they can't share the port.
+    Supported functions:
+        0x03, 0x04 - read holding or input registers (both use the map below)
+        0x06 - write a single register
+        0x10 - write multiple registers
+    Once a frame has been answered the temperature lines and verbose output are
+    held back, so they can't get mixed up with the replies, until a text
+    command is entered.
+*/
+
+#define MODBUS_FRAME_SIZE 64
+#define MODBUS_MAX_READ ((MODBUS_FRAME_SIZE - 5) / 2) // registers that fit in one reply
+#define MODBUS_BROADCAST 0
+#define MODBUS_UNKNOWN_LENGTH 0xFF
+const unsigned long modbusFrameTimeout = 20; // ms
+
+#define MODBUS_READ_HOLDING 0x03
+#define MODBUS_READ_INPUT 0x04
+#define MODBUS_WRITE_SINGLE 0x06
+#define MODBUS_WRITE_MULTIPLE 0x10
+
+// exception codes, returned with the function code's top bit set
+#define MODBUS_ILLEGAL_ADDRESS 0x02
+#define MODBUS_ILLEGAL_VALUE 0x03
+
+// calibration registers for each sensor, in calibrationData order
+enum modbusCalField : uint8_t{
+    CAL_TEMP_LOW,
+    CAL_TEMP_HIGH,
+    CAL_ADC_LOW,
+    CAL_ADC_HIGH,
+    CAL_OFFSET,
+    CAL_REGISTERS
+};
+
+// register map, temperatures are signed and in 1/tempMultiplyFactor C unless noted
+// 32 bit values are split over two registers, high word first
+enum modbusRegister : uint16_t{
+    REG_TARGET_TEMP = 0,   // RW, whole C, MIN_TEMP to MAX_TEMP
+    REG_RUNNING,           // RW, 0 or 1
+    REG_CASCADE,           // RW, cascade control 0 or 1
+    REG_AMBIENT_TEMP,      // R, last ambient reading
+    REG_HEATER_TEMP,       // R, last heater reading
+    REG_HEATER_ON,         // R, heater outputs, a bit per zone
+    REG_HEATER_SETPOINT,   // R, cascade heater setpoint
+    REG_CAL_AMBIENT,       // RW, CAL_REGISTERS registers, as the 'c' and 'o' commands
+    REG_CAL_HEATER = REG_CAL_AMBIENT + CAL_REGISTERS,
+    REG_CAL_SAVE = REG_CAL_HEATER + CAL_REGISTERS, // W, write 1 to save the calibration to the EEPROM
+    REG_ENERGY_HIGH,       // R, lifetime energy, Wh
+    REG_ENERGY_LOW,
+    REG_ON_TIME_HIGH,      // R, lifetime heater on-time, seconds
+    REG_ON_TIME_LOW,
+    REG_DUTY_MINUTE,       // R, duty over the last minute, 0.1%
+    REG_DUTY_HOUR,         // R, duty over the last hour, 0.1%
+    REG_UPTIME_HIGH,       // R, seconds since reset
+    REG_UPTIME_LOW,
+    REG_TRACE_COUNT,       // R, events in the trace buffer
+    REG_COUNT
+};
+
+// states returned by modbusReceive
+enum modbusState : uint8_t{
+    MODBUS_TEXT,           // the byte is for the text console
+    MODBUS_RECEIVING,      // the byte was taken as part of a frame
+    MODBUS_HANDLED,        // the byte completed a frame
+};
+
+uint8_t modbusFrame[MODBUS_FRAME_SIZE]; // the request, then the reply built over it
+uint8_t modbusLength = 0;
+bool modbusDiscarding = false;          // skipping a frame we can't parse
+uint32_t modbusLastByte = 0;
+
+uint16_t modbusCrc(const uint8_t *data, uint8_t length){
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < length; i++){
+        crc = _crc16_update(crc, data[i]);
+    }
+    return crc;
+}
+
+// registers are big endian on the wire
+uint16_t modbusWord(uint8_t index){
+    return ((uint16_t)modbusFrame[index] << 8) | modbusFrame[index + 1];
+}
+
+void modbusPutWord(uint8_t index, uint16_t value){
+    modbusFrame[index] = value >> 8;
+    modbusFrame[index + 1] = value & 0xFF;
+}
+
+/***
+ * Read one register from the map
+ * Input: reg - register address, below REG_COUNT
+ * Output: the register value
+*/
+uint16_t modbusReadRegister(uint16_t reg){
+    if (reg >= REG_CAL_AMBIENT && reg < REG_CAL_SAVE){
+        calibrationData *cal = &calibration[(reg - REG_CAL_AMBIENT) / CAL_REGISTERS];
+        switch ((reg - REG_CAL_AMBIENT) % CAL_REGISTERS){
+            case CAL_TEMP_LOW: return cal->tempLow;
+            case CAL_TEMP_HIGH: return cal->tempHigh;
+            case CAL_ADC_LOW: return cal->adcLow;
+            case CAL_ADC_HIGH: return cal->adcHigh;
+            default: return cal->offset;
+        }
+    }
+    switch (reg){
+        case REG_TARGET_TEMP: return targetTemp;
+        case REG_RUNNING: return running;
+        case REG_CASCADE: return cascadeControl;
+        case REG_AMBIENT_TEMP: return lastTemp[SENSOR_AMBIENT];
+        case REG_HEATER_TEMP: return lastTemp[SENSOR_HEATER];
+        case REG_HEATER_ON:
+        {
+            uint16_t outputs = 0;
+            for (uint8_t z = 0; z < HEATER_ZONES; z++){
+                if (heaterOn[z]) outputs |= 1 << z;
+            }
+            return outputs;
+        }
+        case REG_HEATER_SETPOINT: return heaterSetpoint;
+        case REG_ENERGY_HIGH: return lifetime.wattHours >> 16;
+        case REG_ENERGY_LOW: return lifetime.wattHours & 0xFFFF;
+        case REG_ON_TIME_HIGH: return lifetime.onSeconds >> 16;
+        case REG_ON_TIME_LOW: return lifetime.onSeconds & 0xFFFF;
+        case REG_DUTY_MINUTE: return windowDuty(minuteWindow.sum, minuteWindow.filled * (meterBucketPeriod / 1000));
+        case REG_DUTY_HOUR: return windowDuty(hourWindow.sum, hourWindow.filled * 300UL);
+        case REG_UPTIME_HIGH: return (millis() / 1000) >> 16;
+        case REG_UPTIME_LOW: return (millis() / 1000) & 0xFFFF;
+        case REG_TRACE_COUNT: return traceBuffer.count;
+    }
+    return 0; // REG_CAL_SAVE reads as 0
+}
+
+/***
+ * Check, and optionally make, a write to one register
+ * Input: reg - register address
+ *        value - the value to write
+ *        apply - false to only check the write
+ * Output: 0 if the write is allowed, otherwise the exception code
+*/
+uint8_t modbusWriteRegister(uint16_t reg, uint16_t value, bool apply){
+    int16_t signedValue = value;
+    if (reg >= REG_CAL_AMBIENT && reg < REG_CAL_SAVE){
+        uint8_t sensorId = (reg - REG_CAL_AMBIENT) / CAL_REGISTERS;
+        uint8_t field = (reg - REG_CAL_AMBIENT) % CAL_REGISTERS;
+        calibrationData *cal = &calibration[sensorId];
+        // ADC readings 0 to 1023, temperatures within the NTC's -125 to 125C, which
+        // is wider than the console allows so the default 110C point reads back
+        if (field == CAL_ADC_LOW || field == CAL_ADC_HIGH){
+            if (value > 1023) return MODBUS_ILLEGAL_VALUE;
+        } else if (signedValue < -125 * tempMultiplyFactor || signedValue > 125 * tempMultiplyFactor){
+            return MODBUS_ILLEGAL_VALUE;
+        }
+        if (!apply) return 0;
+        switch (field){
+            case CAL_TEMP_LOW: cal->tempLow = signedValue; break;
+            case CAL_TEMP_HIGH: cal->tempHigh = signedValue; break;
+            case CAL_ADC_LOW: cal->adcLow = value; break;
+            case CAL_ADC_HIGH: cal->adcHigh = value; break;
+            case CAL_OFFSET: cal->offset = signedValue; break;
+        }
+        char fieldName = field == CAL_OFFSET ? 'o' : (field == CAL_TEMP_LOW || field == CAL_ADC_LOW) ? 'l' : 'h';
+        trace(TRACE_CALIBRATION, (sensorId << 8) | fieldName, signedValue);
+        return 0;
+    }
+    switch (reg){
+        case REG_TARGET_TEMP:
+            if (signedValue < MIN_TEMP || signedValue > MAX_TEMP) return MODBUS_ILLEGAL_VALUE;
+            if (apply){
+                targetTemp = signedValue;
+                trace(TRACE_TARGET, targetTemp);
+            }
+            return 0;
+        case REG_RUNNING:
+            if (value > 1) return MODBUS_ILLEGAL_VALUE;
+            if (apply) running = value;
+            return 0;
+        case REG_CASCADE:
+            // the zone controllers don't use cascade control
+            if (value > 1 || (value == 1 && HEATER_ZONES > 1)) return MODBUS_ILLEGAL_VALUE;
+            if (apply && cascadeControl != (value == 1)){
+                cascadeControl = value;
+                resetCascade();
+            }
+            return 0;
+        case REG_CAL_SAVE:
+            if (value != 1) return MODBUS_ILLEGAL_VALUE;
+            if (apply) storeCal();
+            return 0;
+    }
+    // read only, or not in the map
+    return MODBUS_ILLEGAL_ADDRESS;
+}
+
+/***
+ * Work out the length of the frame being received
+ * Output: the length including the CRC, 0 if more bytes are needed to tell,
+ *         or MODBUS_UNKNOWN_LENGTH for a frame that can't be handled
+*/
+uint8_t modbusFrameLength(){
+    if (modbusLength < 2) return 0;
+    switch (modbusFrame[1]){
+        case MODBUS_READ_HOLDING:
+        case MODBUS_READ_INPUT:
+        case MODBUS_WRITE_SINGLE:
+            return 8;
+        case MODBUS_WRITE_MULTIPLE:
+            // address, function, start, count, byte count, data, CRC
+            if (modbusLength < 7) return 0;
+            if (modbusFrame[6] > MODBUS_FRAME_SIZE - 9) return MODBUS_UNKNOWN_LENGTH;
+            return 9 + modbusFrame[6];
+    }
+    return MODBUS_UNKNOWN_LENGTH;
+}
+
+// check a read or write range against the map
+uint8_t modbusCheckRange(uint16_t start, uint16_t count, uint16_t maxCount){
+    if (count == 0 || count > maxCount) return MODBUS_ILLEGAL_VALUE;
+    if (start >= REG_COUNT || count > REG_COUNT - start) return MODBUS_ILLEGAL_ADDRESS;
+    return 0;
+}
+
+/***
+ * Act on a complete frame and send the reply
+ * Frames with a bad CRC get no reply, as do broadcasts
+ * Output: false if the CRC was bad
+*/
+bool modbusHandleFrame(){
+    if (modbusCrc(modbusFrame, modbusLength) != 0) return false; // the CRC over a good frame is 0
+    bool broadcast = modbusFrame[0] == MODBUS_BROADCAST;
+    uint8_t function = modbusFrame[1];
+    uint16_t start = modbusWord(2);
+    uint16_t count = modbusWord(4); // the value for a single write
+    uint8_t exception = 0;
+    uint8_t replyLength = 6;        // writes echo the address, function, start and count
+    modbusActive = true;
+
+    switch (function){
+        case MODBUS_READ_HOLDING:
+        case MODBUS_READ_INPUT:
+            if (broadcast) return true;
+            exception = modbusCheckRange(start, count, MODBUS_MAX_READ);
+            if (exception) break;
+            modbusFrame[2] = count * 2;
+            for (uint8_t i = 0; i < count; i++){
+                modbusPutWord(3 + i * 2, modbusReadRegister(start + i));
+            }
+            replyLength = 3 + count * 2;
+            break;
+        case MODBUS_WRITE_SINGLE:
+            exception = modbusWriteRegister(start, count, true);
+            break;
+        case MODBUS_WRITE_MULTIPLE:
+            exception = modbusCheckRange(start, count, REG_COUNT);
+            if (!exception && modbusFrame[6] != count * 2) exception = MODBUS_ILLEGAL_VALUE;
+            // check every register first so a bad value doesn't leave a partial write
+            for (uint8_t i = 0; i < count && !exception; i++){
+                exception = modbusWriteRegister(start + i, modbusWord(7 + i * 2), false);
+            }
+            for (uint8_t i = 0; i < count && !exception; i++){
+                modbusWriteRegister(start + i, modbusWord(7 + i * 2), true);
+            }
+            break;
+    }
+    // plain reads aren't traced, a master polling them would push the
+    // control decisions out of the buffer
+    bool write = function == MODBUS_WRITE_SINGLE || function == MODBUS_WRITE_MULTIPLE;
+    if (write || exception){
+        trace(TRACE_REGISTER, (function << 8) | exception, start);
+    }
+    if (broadcast) return true;
+
+    if (exception){
+        modbusFrame[1] = function | 0x80;
+        modbusFrame[2] = exception;
+        replyLength = 3;
+    }
+    // append the CRC and send the reply in one go
+    uint16_t crc = modbusCrc(modbusFrame, replyLength);
+    modbusFrame[replyLength++] = crc & 0xFF;
+    modbusFrame[replyLength++] = crc >> 8;
+    Serial.write(modbusFrame, replyLength);
+    return true;
+}
+
+// a frame can start with any address that isn't a character the console uses
+bool modbusFrameStart(uint8_t c){
+    return c < 32 && c != '\b' && c != '\n' && c != '\r';
+}
+
+/***
+ * Pass a received byte through the frame decoder
+ * Input: c - the byte read from the serial port
+ * Output: a modbusState, MODBUS_TEXT if the console should handle the byte
+*/
+uint8_t modbusReceive(uint8_t c){
+    uint32_t now = millis();
+    if ((modbusLength > 0 || modbusDiscarding) && now - modbusLastByte > modbusFrameTimeout){
+        // the rest of the frame never came
+        modbusLength = 0;
+        modbusDiscarding = false;
+    }
+    modbusLastByte = now;
+    if (modbusDiscarding) return MODBUS_RECEIVING;
+    if (modbusLength == 0 && !modbusFrameStart(c)){
+        return MODBUS_TEXT;
+    }
+
+    modbusFrame[modbusLength++] = c;
+    uint8_t expected = modbusFrameLength();
+    if (expected == MODBUS_UNKNOWN_LENGTH){
+        // the end can't be found, so skip everything up to the next gap
+        modbusLength = 0;
+        modbusDiscarding = true;
+    } else if (expected != 0 && modbusLength >= expected){
+        bool ours = modbusFrame[0] == modbusAddress || modbusFrame[0] == MODBUS_BROADCAST;
+        bool handled = ours && modbusHandleFrame();
+        modbusLength = 0;
+        if (!handled){
+            // another slave's frame, or a damaged one, skip whatever follows it
+            // up to the next gap, such as the other slave's reply
+            modbusDiscarding = true;
+            return MODBUS_RECEIVING;
+        }
+        return MODBUS_HANDLED;
+    }
+    return MODBUS_RECEIVING;
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef _NOISE_H_
+#define _NOISE_H_
+
+#include "config.h"
+#include <Arduino.h>
+#include <avr/wdt.h>
+#include "calibration.h"
+#include "control.h"
+#include "format.h"
+#include "7segment.h"
+
+extern SegmentDisplay display; // defined in main.cpp
+
+/*
+    ADC noise characterization
+    Takes a few thousand raw conversions from one sensor with the heater and
+    display forced on or off, and reports the spread so the oversample count
+    in readTemp() can be chosen from data instead of guessed.
+    The mean and variance cover every reading, so spikes from the heater
+    switching count towards the suggested oversample. The histogram is only
+    for display, centred on the settled average, and readings outside it are
+    counted as outliers.
+*/
+
+#define NOISE_BINS 64          // histogram covers the centre reading +/- 32 counts
+#define NOISE_MAX_SAMPLES 4096 // keeps the sums within 32 bits
+#define NOISE_DEFAULT_SAMPLES 4096
+#define NOISE_MAX_OVERSAMPLE 64
+#define NOISE_CENTER_SAMPLES 8 // averaged for the histogram centre
+const unsigned long noiseSettleTime = 20; // ms after switching the heater before sampling
+
+/***
+ * log2 of a 24.8 fixed point value, in 1/16ths
+ * Input: value - the value multiplied by 256, must be at least 1
+*/
+int16_t log2Fixed(uint32_t value){
+    int16_t result = 0;
+    // whole part from the position of the top bit
+    while (value >= 512){
+        value >>= 1;
+        result += 16;
+    }
+    while (value < 256){
+        value <<= 1;
+        result -= 16;
+    }
+    // value is now 1.0 to 2.0 in 8.8, square it to get each fraction bit
+    for (int8_t bit = 8; bit > 0; bit >>= 1){
+        value = (value * value) >> 8;
+        if (value >= 512){
+            value >>= 1;
+            result += bit;
+        }
+    }
+    return result;
+}
+
+/***
+ * Run the noise test and print the results
+ * Input: sensorId - SENSOR_AMBIENT or SENSOR_HEATER
+ *        heater - force the heater on during the test
+ *        displayOn - keep multiplexing the display during the test
+ *        samples - number of conversions, up to NOISE_MAX_SAMPLES
+*/
+void runNoiseTest(int sensorId, bool heater, bool displayOn, uint16_t samples){
+    uint16_t histogram[NOISE_BINS];
+    memset(histogram, 0, sizeof(histogram));
+    uint16_t outliers = 0;
+    int pin = sensorId == SENSOR_AMBIENT ? tempPinAmbient : tempPinHeater;
+    bool wasOn = heaterOn[0];
+
+    if (heater && readTemp(SENSOR_HEATER) > maxHeaterTemp * tempMultiplyFactor){
+        Serial.println(F("Heater is over its limit, not turning it on"));
+        return;
+    }
+    setHeater(heater, REASON_DIAGNOSTIC, 0);
+    if (!displayOn){
+        display.blankDisplay();
+    }
+
+    // let the supply and the ADC settle after the heater switch, then centre
+    // on an average so a single glitch can't push the readings off the histogram
+    delay(noiseSettleTime);
+    uint16_t centerSum = 0;
+    for (uint8_t i = 0; i < NOISE_CENTER_SAMPLES; i++){
+        centerSum += analogRead(pin);
+    }
+    int center = centerSum / NOISE_CENTER_SAMPLES;
+    int low = center - NOISE_BINS / 2;
+    int minimum = center;
+    int maximum = center;
+    // sums are taken relative to the centre to stay small, 4096 readings of
+    // up to 1023 counts away still fit in 32 bits
+    long sum = 0;
+    uint32_t sumSquares = 0;
+    uint32_t start = micros();
+    for (uint16_t i = 0; i < samples; i++){
+        int value = analogRead(pin);
+        int offset = value - center;
+        sum += offset;
+        sumSquares += (uint32_t)((long)offset * offset);
+        if (value < minimum) minimum = value;
+        if (value > maximum) maximum = value;
+        if (value >= low && value < low + NOISE_BINS){
+            histogram[value - low]++;
+        } else {
+            outliers++;
+        }
+        // switch digits about as often as the main loop does
+        if (displayOn && (i & 7) == 0){
+            display.next();
+        }
+        wdt_reset();
+    }
+    uint32_t elapsed = micros() - start;
+    setHeater(wasOn, REASON_DIAGNOSTIC, 0);
+
+    // mean in 1/100 counts, variance in 1/256 counts squared, split so
+    // nothing overflows 32 bits
+    long mean = (long)center * 100 + (sum * 100) / (long)samples;
+    long meanOffset16 = (sum * 16) / (long)samples;
+    uint32_t meanSquare256 = (sumSquares / samples) * 256 + ((sumSquares % samples) * 256) / samples;
+    long varianceSigned = (long)meanSquare256 - meanOffset16 * meanOffset16;
+    uint32_t variance = varianceSigned > 0 ? varianceSigned : 0;
+
+    // ENOB = 10 - log2(sigma * sqrt(12)), only the quantization limit if the noise is smaller
+    int16_t enob = 160;
+    if (variance * 12 > 256){
+        enob = 160 - log2Fixed(variance * 12) / 2;
+    }
+    // oversampling by n divides the variance by n, aim for sigma of 0.5 counts
+    uint8_t oversample = 1;
+    while (oversample < NOISE_MAX_OVERSAMPLE && variance / oversample > 64){
+        oversample <<= 1;
+    }
+
+    LineBuilder line;
+    line.text(F("Noise: sensor "));
+    line.number(sensorId);
+    line.text(heater ? F(", heater on") : F(", heater off"));
+    line.text(displayOn ? F(", display on, ") : F(", display off, "));
+    line.number(samples);
+    line.text(F(" samples, "));
+    line.number(elapsed / samples);
+    line.text(F("us each"));
+    line.send();
+
+    line.text(F("Mean: "));
+    line.decimal(mean, 2);
+    line.text(F(", Variance: "));
+    line.decimal((variance >> 8) * 100 + (((variance & 0xFF) * 100) >> 8), 2);
+    line.text(F(", Min: "));
+    line.number(minimum);
+    line.text(F(", Max: "));
+    line.number(maximum);
+    line.text(F(", Outliers: "));
+    line.number(outliers);
+    line.send();
+
+    line.text(F("ENOB: "));
+    line.decimal((enob * 10) >> 4, 1);
+    line.text(F(" bits, suggested oversample: "));
+    line.number(oversample);
+    line.text(F(" ("));
+    line.number(elapsed / samples * oversample);
+    line.text(F("us per reading)"));
+    line.send();
+
+    // only the bins that were hit, as "<ADC value>: <count>"
+    for (uint8_t b = 0; b < NOISE_BINS; b++){
+        if (histogram[b] == 0) continue;
+        line.text(F("  "));
+        line.number(low + b);
+        line.text(F(": "));
+        line.number(histogram[b]);
+        line.send();
+    }
+}
+
+#endif
@@ -5,6 +5,11 @@
 #include <Arduino.h>
 #include "calibration.h"
 #include "temperature.h"
+#include "control.h"
+#include "zones.h"
+#include "energy.h"
+#include "noise.h"
+#include "modbus.h"
 /*
     * Serial programming functions
 */
@@ -14,14 +19,13 @@ const char INVALID_SENSOR_ID[] PROGMEM = "Invalid sensor ID. Should be 0 (ambien
 const char INVALID_TEMP[] PROGMEM = "Invalid temperature - must be between -100 and 100C";
 const char INVALID_ADC[] PROGMEM = "Invalid ADC reading - must be between 0 and 1023";
 const char INVALID_OFFSET[] PROGMEM = "Invalid offset - must be between -100 and 100";
+// PROGMEM strings have to be printed through the flash string overloads
+#define FLASH_STRING(s) (reinterpret_cast<const __FlashStringHelper *>(s))
 
 void setupSerial(){
     Serial.begin(115200);
 }
 
-#define MAX_TEMP 50
-#define MIN_TEMP 0
-
 void printHelp(){
     Serial.println(F("Serial command reference:"));
     Serial.println(F("    t <temp> - set the target temperature"));
@@ -31,8 +35,15 @@ void printHelp(){
     Serial.println(F("    p - Print Calibration Data"));
     Serial.println(F("    s - save the calibration data to EEPROM"));
     Serial.println(F("    v - toggle verbose mode"));
+    Serial.println(F("    m - toggle cascade control (heater sensor inner loop)"));
+    Serial.println(F("    z [<zone> <temp>] - print the heater zones, or set a zone's target temperature"));
+    Serial.println(F("    e - print heater energy use and duty cycle"));
+    Serial.println(F("    n <sensor (0|1)> <heater (0|1)> <display (0|1)> [samples] - measure the ADC noise"));
+    Serial.println(F("    d - dump the event trace"));
+    Serial.println(F("    x - clear the event trace and restart tracing"));
     Serial.println(F("    1 - begin the heating process"));
     Serial.println(F("    0 - stop regulating temperature"));
+    Serial.println(F("Modbus RTU frames to modbusAddress read and write the registers listed in modbus.h"));
 }
 
 bool checkValidSensor(char *buffer, int bufferLength, int index){
@@ -69,18 +80,28 @@ bool checkValidInt(char *buffer, int bufferLength, int index, long min, long max
         - s - save the calibration data to EEPROM
         - p - Print Calibration Data
         - v - toggle verbose mode
+        - m - toggle cascade control
+        - z [<zone> <temp>] - print the heater zones, or set a zone's target temperature
+        - e - print heater energy use and duty cycle
+        - n <sensor (0|1)> <heater (0|1)> <display (0|1)> [samples] - measure the ADC noise
+        - d - dump the event trace
+        - x - clear the event trace and restart tracing
         - h - print the help message
         - 1 - begin the heating process
         - 0 - stop regulating temperature
+    Binary register frames are picked out of the input by modbusReceive, see modbus.h
 */
 
 // function to parse the serial input
 void parseSerial(char *buffer, int bufferLength){
     // given a buffer, parse the command
     char command = buffer[0];
-    int sensorId, offset;
+    uint8_t sensorId;
+    int offset;
     long actualTemp, adc;
     
+    trace(TRACE_COMMAND, command, bufferLength);
+
     // first check if the command is a single character
     Serial.print(F("[Parsing] Command: "));
     Serial.print(command);
@@ -91,36 +112,38 @@ void parseSerial(char *buffer, int bufferLength){
         switch(command){
             case '0':
                 {running = false;
-                Serial.println("Stopping temperature regulation");
+                Serial.println(F("Stopping temperature regulation"));
                 break;}
             case '1':
                 {running = true;
-                Serial.println("Starting temperature regulation");
+                Serial.println(F("Starting temperature regulation"));
                 break;}
             case 'c':
                 {// calibrate the sensor
                 sensorId = atoi(&buffer[2]);
                 if (!checkValidSensor(buffer, bufferLength, 2)){
-                    Serial.println(INVALID_SENSOR_ID);
+                    Serial.println(FLASH_STRING(INVALID_SENSOR_ID));
                     return;
                 }
                 actualTemp = atol(&buffer[4]);
                 if (!checkValidInt(buffer, bufferLength, 4, -100, 100)){
-                    Serial.println(INVALID_TEMP);
+                    Serial.println(FLASH_STRING(INVALID_TEMP));
                     return;
                 }
                 adc = atol(&buffer[7]);
                 if (!checkValidInt(buffer, bufferLength, 7, 0, 1023)){
-                    Serial.println(INVALID_ADC);
+                    Serial.println(FLASH_STRING(INVALID_ADC));
                     return;
                 }
                 if (actualTemp < 30){
                     calibration[sensorId].adcLow = adc;
                     calibration[sensorId].tempLow = actualTemp * tempMultiplyFactor;
+                    trace(TRACE_CALIBRATION, (sensorId << 8) | 'l', adc);
                     Serial.println(F("Low calibration point set"));
                 } else {
                     calibration[sensorId].adcHigh = adc;
                     calibration[sensorId].tempHigh = actualTemp * tempMultiplyFactor;
+                    trace(TRACE_CALIBRATION, (sensorId << 8) | 'h', adc);
                     Serial.println(F("High calibration point set"));
                 }
                 calibration[sensorId].offset = 0;
@@ -134,15 +157,16 @@ void parseSerial(char *buffer, int bufferLength){
                 {// set the offset for the sensor
                 sensorId = atoi(&buffer[2]);
                 if (!checkValidSensor(buffer, bufferLength, 2)){
-                    Serial.println(INVALID_SENSOR_ID);
+                    Serial.println(FLASH_STRING(INVALID_SENSOR_ID));
                     return;
                 }
                 offset = atoi(&buffer[4]);
                 if (!checkValidInt(buffer, bufferLength, 4, -100, 100)){
-                    Serial.println(F("Invalid offset"));
+                    Serial.println(FLASH_STRING(INVALID_OFFSET));
                     return;
                 }
                 calibration[sensorId].offset = offset * tempMultiplyFactor;
+                trace(TRACE_CALIBRATION, (sensorId << 8) | 'o', calibration[sensorId].offset);
                 break;}
             case 'p':
                 {// print the calibration data
@@ -152,7 +176,7 @@ void parseSerial(char *buffer, int bufferLength){
                 {// read the temperature from the sensor
                 bool oldVerbose = verbose;
                 verbose = true;
-                int sensorId = atoi(&buffer[2]);
+                uint8_t sensorId = atoi(&buffer[2]);
                 if (!checkValidSensor(buffer, bufferLength, 2)){
                     Serial.println();
                     return;
@@ -167,13 +191,13 @@ void parseSerial(char *buffer, int bufferLength){
             }
             case 't':
             {
-                // set the target temperature
-                targetTemp = atol(&buffer[2]);
-
-                if (targetTemp < MIN_TEMP || targetTemp > MAX_TEMP){
+                // set the target temperature, only once it has been checked
+                if (!checkValidInt(buffer, bufferLength, 2, MIN_TEMP, MAX_TEMP)){
                     Serial.println(F("Invalid Temperature - must be between 0 and 50C"));
                     return;
                 }
+                targetTemp = atol(&buffer[2]);
+                trace(TRACE_TARGET, targetTemp);
                 Serial.print(F("Target temperature set to "));
                 Serial.print(targetTemp);
                 Serial.println(F("C"));
@@ -183,39 +207,113 @@ void parseSerial(char *buffer, int bufferLength){
             {
                 verbose = !verbose;
                 Serial.print(F("Verbose mode: "));
-                Serial.println(verbose ? "ON" : "OFF");
+                Serial.println(verbose ? F("ON") : F("OFF"));
+                break;
+            }
+            case 'z':
+            {
+                if (bufferLength == 1){
+                    printZones();
+                    break;
+                }
+                // zone 0 follows the main target temperature, set with 't'
+                if (!checkValidInt(buffer, bufferLength, 2, 1, HEATER_ZONES - 1)){
+                    Serial.println(F("Invalid zone"));
+                    return;
+                }
+                uint8_t zone = atoi(&buffer[2]);
+                if (!checkValidInt(buffer, bufferLength, 4, MIN_TEMP, MAX_TEMP)){
+                    Serial.println(F("Invalid Temperature - must be between 0 and 50C"));
+                    return;
+                }
+                zones[zone].target = atol(&buffer[4]);
+                trace(TRACE_TARGET, zones[zone].target, zone);
+                printZones();
+                break;
+            }
+            case 'e':
+            {
+                printEnergy();
+                break;
+            }
+            case 'n':
+            {
+                if (!checkValidSensor(buffer, bufferLength, 2)){
+                    Serial.println(FLASH_STRING(INVALID_SENSOR_ID));
+                    return;
+                }
+                if (!checkValidInt(buffer, bufferLength, 4, 0, 1) || !checkValidInt(buffer, bufferLength, 6, 0, 1)){
+                    Serial.println(F("Heater and display must be 0 (off) or 1 (on)"));
+                    return;
+                }
+                uint16_t samples = NOISE_DEFAULT_SAMPLES;
+                if (bufferLength > 8){
+                    if (!checkValidInt(buffer, bufferLength, 8, 1, NOISE_MAX_SAMPLES)){
+                        Serial.println(F("Invalid sample count - must be between 1 and 4096"));
+                        return;
+                    }
+                    samples = atoi(&buffer[8]);
+                }
+                runNoiseTest(atoi(&buffer[2]), atoi(&buffer[4]), atoi(&buffer[6]), samples);
+                break;
+            }
+            case 'd':
+            {
+                dumpTrace();
+                break;
+            }
+            case 'x':
+            {
+                clearTrace();
+                Serial.println(F("Trace cleared"));
+                break;
+            }
+            case 'm':
+            {
+                if (HEATER_ZONES > 1){
+                    Serial.println(F("Cascade control is not used with more than one zone"));
+                    return;
+                }
+                cascadeControl = !cascadeControl;
+                resetCascade();
+                Serial.print(F("Cascade control: "));
+                Serial.println(cascadeControl ? F("ON") : F("OFF"));
                 break;
             }
             default:
             {
-                Serial.print("Unknown command: ");
+                Serial.print(F("Unknown command: "));
                 Serial.println(command);
                 break;
             }
         }
     }
     else {
-        Serial.print("Unknown command: ");
+        Serial.print(F("Unknown command: "));
         Serial.println(command);
     }
 }
 
 // function to read lines from serial without blocking
 bool handleSerial(){
-    static int bufferIndex = 0;
+    // the buffer is terminated when a line is parsed, so it never needs clearing
+    static uint8_t bufferIndex = 0;
     static char buffer[SERIAL_BUFFER_SIZE];
     static bool overrun = false;
-    static bool init = false;
-    const int bufferLength = SERIAL_BUFFER_SIZE;
-
-    // zero out the buffer
-    if(!init){
-        memset(buffer, 0, bufferLength);
-        init = true;
-    }
+    const uint8_t bufferLength = SERIAL_BUFFER_SIZE - 1; // room for the terminator
 
     while(Serial.available() > 0){
         char c = Serial.read();
+        uint8_t frame = modbusReceive(c);
+        if (frame == MODBUS_HANDLED){
+            // a frame replaces any half typed line, and may have changed the state
+            overrun = false;
+            bufferIndex = 0;
+            return true;
+        }
+        if (frame == MODBUS_RECEIVING){
+            continue;
+        }
         // Serial.print(F("received: 0x"));
         // Serial.print(c, HEX);
         // Serial.print(F(" bufferIndex: "));
@@ -224,6 +322,8 @@ bool handleSerial(){
             continue;
         }
         if(c == '\n'){
+            // someone is at the console, so show the temperatures again
+            modbusActive = false;
             // parse the buffer
             if (bufferIndex == 0) return true;
             if (!overrun) {
@@ -232,7 +332,6 @@ bool handleSerial(){
             }
             Serial.print(F("> "));
             overrun = false;
-            memset(buffer, 0, bufferLength);
             bufferIndex = 0;
             return true;
         }
@@ -241,7 +340,7 @@ bool handleSerial(){
             if( c== 0x7F || c == 0x08){
                 // backspace
                 if(bufferIndex > 0){
-                    buffer[bufferIndex--] = 0;
+                    bufferIndex--;
                     Serial.write(0x08);
                     Serial.write(' ');
                     Serial.write(0x08);
@@ -4,11 +4,10 @@
 #include "config.h"
 #include <Arduino.h>
 #include "calibration.h"
+#include "format.h"
 
 
 extern bool verbose; // defined in main.cpp
-// Make sure that the suffixes array is the same length as the tempMultiplyFactor
-const char *suffixes[] = {".000", ".125", ".250", ".375", ".500", ".625", ".750", ".875"};
 
 const long tempHysteresis = 1;
 const long maxHeaterTemp = 80;
@@ -19,24 +18,25 @@ void setupAdc(){
 }
 
 void printTempVerbose(int sensorId, long temperature, uint32_t adc){
-    Serial.print("Sensor: ");
-    Serial.print(sensorId == SENSOR_AMBIENT ? "Ambient" : "Heater");
-    Serial.print("ADC: ");
-    Serial.print(adc);
-    Serial.print(", Temp: ");
-    Serial.print(temperature / tempMultiplyFactor);
-    Serial.print(suffixes[temperature % tempMultiplyFactor]);
-    Serial.println("C");
+    LineBuilder line;
+    line.text(F("Sensor: "));
+    line.text(sensorId == SENSOR_AMBIENT ? F("Ambient") : F("Heater"));
+    line.text(F(", ADC: "));
+    line.number(adc);
+    line.text(F(", Temp: "));
+    line.fixed(temperature, tempFractionBits);
+    line.character('C');
+    line.send();
 }
 
 /***
- * Read the temperature from the sensor
+ * Read the temperature from a sensor on any pin
  * Input: pin - the pin the sensor is connected to
+ *        sensorId - the sensor whose calibration to use
  * Output: the temperature in Celsius, multiplied by tempMultiplyFactor
 */
-long readTemp(int sensorId, int oversample = 8){
+long readTempPin(int pin, int sensorId, int oversample = 8){
   uint32_t sum = 0;
-  int pin = sensorId == SENSOR_AMBIENT ? tempPinAmbient : tempPinHeater;
   calibrationData *cal = &calibration[sensorId];
   // read the value from the sensor
   for (int counter = 0; counter < oversample; counter++){
@@ -62,21 +62,35 @@ long readTemp(int sensorId, int oversample = 8){
   
   // Serial.print("Raw Temperature: ");
   // Serial.println(temperature);
-  if(verbose){
+  if(verbose && !modbusActive){
     printTempVerbose(sensorId, temperature, val);
   }
 
   return temperature;
 }
 
+// the most recent reading of each sensor, for the register protocol
+long lastTemp[2] = {0, 0};
+
+/***
+ * Read the temperature from the sensor
+ * Input: sensorId - SENSOR_AMBIENT or SENSOR_HEATER
+ * Output: the temperature in Celsius, multiplied by tempMultiplyFactor
+*/
+long readTemp(int sensorId, int oversample = 8){
+  int pin = sensorId == SENSOR_AMBIENT ? tempPinAmbient : tempPinHeater;
+  lastTemp[sensorId] = readTempPin(pin, sensorId, oversample);
+  return lastTemp[sensorId];
+}
+
 void printTemps(long tempAmbient, long tempHeater){
-  Serial.print("Ambient: ");
-  Serial.print(tempAmbient / tempMultiplyFactor);
-  Serial.print(suffixes[tempAmbient % tempMultiplyFactor]);
-  Serial.print("C, Heater: ");
-  Serial.print(tempHeater / tempMultiplyFactor);
-  Serial.print(suffixes[tempHeater % tempMultiplyFactor]);
-  Serial.println("C");
+  LineBuilder line;
+  line.text(F("Ambient: "));
+  line.fixed(tempAmbient, tempFractionBits);
+  line.text(F("C, Heater: "));
+  line.fixed(tempHeater, tempFractionBits);
+  line.character('C');
+  line.send();
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,153 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <Arduino.h>
+#include "format.h"
+
+/*
+    Event trace recorder
+    Control decisions are logged as small binary events in a RAM ring buffer,
+    so the path that switched the heater can be worked out afterwards. The
+    buffer is in .noinit RAM, so it also survives a watchdog reset.
+    Recording stops (the buffer freezes) on a fault, keeping the events that
+    led up to it until the 'x' command restarts tracing.
+    Events only keep the low 16 bits of millis(), which wrap every 65.5s, so
+    a heartbeat is recorded whenever nothing else has been for 30s. No gap is
+    then long enough to wrap, and the heartbeat carries the high bits.
+    'd' dumps the buffer as hex, decode it with tools/trace_decode.py.
+*/
+
+#define TRACE_SIZE 64 // events, must be a power of two
+#define TRACE_MAGIC 0x5452
+const unsigned long traceHeartbeatPeriod = 30000; // ms, well inside the 16 bit time
+
+// event IDs, keep in step with tools/trace_decode.py
+enum traceEventId : uint8_t{
+    TRACE_RESET = 1,       // a: RSTCTRL.RSTFR, b: 1 if warm restart
+    TRACE_SAMPLE,          // a: ambient temp, b: heater temp
+    TRACE_HEATER_ON,       // a: zone << 8 | traceReason, b: temp that caused it
+    TRACE_HEATER_OFF,      // a: zone << 8 | traceReason, b: temp that caused it
+    TRACE_COMMAND,         // a: command character, b: line length
+    TRACE_TARGET,          // a: new target temp (C), b: zone
+    TRACE_CALIBRATION,     // a: sensor << 8 | field ('l', 'h' or 'o'), b: ADC value or offset
+    TRACE_EEPROM_WRITE,    // a: 0 calibration, 1 wipe, 2 energy meter
+    TRACE_SETPOINT,        // a: heater setpoint, b: cascade integral
+    TRACE_FAULT,           // a: traceReason, b: value
+    TRACE_ZONE,            // a: zone << 8 | slots asked for, b: slots granted
+    TRACE_REGISTER,        // writes and exceptions only, a: function << 8 | exception code (0 if none), b: first register
+    TRACE_HEARTBEAT,       // a: millis() high 16 bits
+};
+
+// why the heater was switched, or why a fault was raised
+enum traceReason : uint8_t{
+    REASON_STARTUP,
+    REASON_STOPPED,        // regulation turned off
+    REASON_HEATER_LIMIT,   // heater above maxHeaterTemp
+    REASON_HYSTERESIS,     // ambient outside the hysteresis band
+    REASON_CASCADE,        // cascade inner loop
+    REASON_WATCHDOG,       // watchdog reset
+    REASON_DIAGNOSTIC,     // forced by the ADC noise test
+    REASON_SCHEDULE,       // zone slot schedule
+};
+
+// 7 bytes per event, temperatures are in 1/tempMultiplyFactor C
+struct traceEvent{
+    uint16_t time; // millis(), low 16 bits
+    uint8_t id;
+    int16_t a;
+    int16_t b;
+};
+
+struct traceLog{
+    uint16_t magic;
+    uint8_t head;   // next slot to write
+    uint8_t count;  // events held, up to TRACE_SIZE
+    bool frozen;
+    traceEvent events[TRACE_SIZE];
+};
+
+traceLog traceBuffer __attribute__((section(".noinit")));
+uint32_t traceLastEvent = 0;
+
+void clearTrace(){
+    traceBuffer.magic = TRACE_MAGIC;
+    traceBuffer.head = 0;
+    traceBuffer.count = 0;
+    traceBuffer.frozen = false;
+}
+
+/***
+ * Set up the trace buffer at startup
+ * Input: resetFlags - the reset cause (RSTCTRL.RSTFR bits) from setup()
+ * A buffer that survived the reset is kept
+*/
+void setupTrace(uint8_t resetFlags){
+    if ((resetFlags & RSTCTRL_PORF_bm) || traceBuffer.magic != TRACE_MAGIC
+        || traceBuffer.head >= TRACE_SIZE || traceBuffer.count > TRACE_SIZE){
+        clearTrace();
+    }
+}
+
+// record an event, does nothing while the buffer is frozen
+void trace(uint8_t id, int16_t a = 0, int16_t b = 0){
+    if (traceBuffer.frozen) return;
+    traceEvent *event = &traceBuffer.events[traceBuffer.head];
+    traceLastEvent = millis();
+    event->time = traceLastEvent;
+    event->id = id;
+    event->a = a;
+    event->b = b;
+    traceBuffer.head = (traceBuffer.head + 1) & (TRACE_SIZE - 1);
+    if (traceBuffer.count < TRACE_SIZE) traceBuffer.count++;
+}
+
+// call from the loop, records a heartbeat after traceHeartbeatPeriod without events
+void traceHeartbeat(){
+    uint32_t now = millis();
+    if (now - traceLastEvent >= traceHeartbeatPeriod){
+        trace(TRACE_HEARTBEAT, now >> 16);
+    }
+}
+
+// record a fault and freeze the buffer so the events before it are kept
+void traceFault(uint8_t reason, int16_t value){
+    if (traceBuffer.frozen) return;
+    trace(TRACE_FAULT, reason, value);
+    traceBuffer.frozen = true;
+}
+
+/***
+ * Record the reset once startup knows how it went
+ * Input: resetFlags - the reset cause (RSTCTRL.RSTFR bits) from setup()
+ *        warm - true if the control state was restored
+ * A watchdog reset is also logged as a fault, which freezes the buffer
+*/
+void traceReset(uint8_t resetFlags, bool warm){
+    trace(TRACE_RESET, resetFlags, warm);
+    if (resetFlags & RSTCTRL_WDRF_bm){
+        traceFault(REASON_WATCHDOG, resetFlags);
+    }
+}
+
+// dump the events oldest first, one "T <hex>" line each, little endian as stored
+void dumpTrace(){
+    LineBuilder line;
+    line.text(F("Trace: "));
+    line.number(traceBuffer.count);
+    line.text(traceBuffer.frozen ? F(" events, frozen") : F(" events"));
+    line.send();
+
+    uint8_t index = (traceBuffer.head - traceBuffer.count) & (TRACE_SIZE - 1);
+    for (uint8_t i = 0; i < traceBuffer.count; i++){
+        const uint8_t *data = (const uint8_t *)&traceBuffer.events[index];
+        line.text(F("T "));
+        for (uint8_t j = 0; j < sizeof(traceEvent); j++){
+            line.hex(data[j]);
+        }
+        line.send();
+        index = (index + 1) & (TRACE_SIZE - 1);
+    }
+    Serial.println(F("Trace end"));
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _WARMSTART_H_
+#define _WARMSTART_H_
+
+#include "config.h"
+#include <Arduino.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+#include "calibration.h"
+#include "control.h"
+#include "zones.h"
+#include "energy.h"
+
+/*
+    Warm restart support
+    A copy of the control state is kept in RAM that the C runtime doesn't clear
+    at startup (.noinit). After a watchdog, brown-out or software reset the copy
+    is checked and restored, so the firmware skips the EEPROM scan and start
+    delay and carries on regulating with the same setpoint.
+    After a power-on the RAM contents are random, so the magic number and CRC
+    reject the copy and the normal cold start runs.
+*/
+
+#define WARM_STATE_MAGIC 0x4D33
+// reset causes that leave RAM intact
+#define WARM_RESET_FLAGS (RSTCTRL_WDRF_bm | RSTCTRL_BORF_bm | RSTCTRL_SWRF_bm)
+
+struct warmState{
+    uint16_t magic;
+    long targetTemp;
+    bool running;
+    bool cascadeControl;
+    long heaterSetpoint;
+    long cascadeIntegral;
+    calibrationData calibration[2];
+    heaterZone zones[HEATER_ZONES];
+    meterTotals lifetime;
+    uint16_t crc;
+};
+
+warmState savedState __attribute__((section(".noinit")));
+
+uint16_t warmStateCrc(){
+    uint16_t crc = 0xFFFF;
+    const uint8_t *data = (const uint8_t *)&savedState;
+    for (uint16_t i = 0; i < offsetof(warmState, crc); i++){
+        crc = _crc_ccitt_update(crc, data[i]);
+    }
+    return crc;
+}
+
+// copy the current control state into the .noinit block
+void saveWarmState(){
+    savedState.magic = WARM_STATE_MAGIC;
+    savedState.targetTemp = targetTemp;
+    savedState.running = running;
+    savedState.cascadeControl = cascadeControl;
+    savedState.heaterSetpoint = heaterSetpoint;
+    savedState.cascadeIntegral = cascadeIntegral;
+    memcpy(savedState.calibration, calibration, sizeof(calibration));
+    memcpy(savedState.zones, zones, sizeof(zones));
+    savedState.lifetime = lifetime;
+    savedState.crc = warmStateCrc();
+}
+
+/***
+ * Restore the control state after a reset that kept the RAM contents
+ * Input: resetFlags - the reset cause (RSTCTRL.RSTFR bits) from setup()
+ * Output: true if the state was restored, false if a cold start is needed
+*/
+bool restoreWarmState(uint8_t resetFlags){
+    if ((resetFlags & RSTCTRL_PORF_bm) || !(resetFlags & WARM_RESET_FLAGS)){
+        return false;
+    }
+    if (savedState.magic != WARM_STATE_MAGIC || savedState.crc != warmStateCrc()){
+        return false;
+    }
+    targetTemp = savedState.targetTemp;
+    running = savedState.running;
+    cascadeControl = savedState.cascadeControl;
+    heaterSetpoint = savedState.heaterSetpoint;
+    cascadeIntegral = savedState.cascadeIntegral;
+    memcpy(calibration, savedState.calibration, sizeof(calibration));
+    memcpy(zones, savedState.zones, sizeof(zones));
+    lifetime = savedState.lifetime;
+    return true;
+}
+
+// enable the watchdog, it has to be fed with wdt_reset() every loop
+void setupWatchdog(){
+    _PROTECTED_WRITE(WDT.CTRLA, WDT_PERIOD_4KCLK_gc); // about 4 seconds
+}
+
+#endif
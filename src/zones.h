@@ -0,0 +1,266 @@
+#ifndef _ZONES_H_
+#define _ZONES_H_
+
+#include "config.h"
+#include <Arduino.h>
+#include "calibration.h"
+#include "temperature.h"
+#include "format.h"
+#include "trace.h"
+#include "energy.h"
+#include "control.h"
+
+/*
+    Multi-zone heater control
+    Each zone has its own sensor, setpoint and PI controller, which asks for a
+    duty cycle as a number of slots in a 1 second frame. The scheduler then
+    places every zone's slots in the frame so the heaters that are on together
+    never draw more than zoneCurrentBudget, and where it can, so no two zones
+    switch on in the same slot, spreading out the inrush current.
+    Only used when HEATER_ZONES is more than 1, a single zone uses the normal
+    hysteresis or cascade control.
+*/
+
+#define ZONE_SLOTS 10                         // slots per frame, at most 16
+const unsigned long zoneSlotPeriod = 100;     // ms per slot
+const long zoneBand = 2 * tempMultiplyFactor; // proportional band, full duty 2C below target
+const long zoneIntegralShift = 6;             // integral term is the summed error divided by 64
+
+struct heaterZone{
+    long target;      // C
+    long temperature; // C multiplied by tempMultiplyFactor
+    long integral;
+    uint8_t duty;     // slots asked for by the controller
+    uint8_t granted;  // slots the scheduler could fit in
+    uint16_t slots;   // bitmask of the slots the zone is on for
+};
+
+heaterZone zones[HEATER_ZONES];
+uint8_t zoneSlot = ZONE_SLOTS - 1; // so the first step starts a frame
+
+void setupZones(){
+    for (uint8_t z = 0; z < HEATER_ZONES; z++){
+        zones[z].target = targetTemp;
+        zones[z].integral = 0;
+        zones[z].slots = 0;
+        pinMode(zoneConfigs[z].outputPin, OUTPUT);
+        digitalWrite(zoneConfigs[z].outputPin, LOW);
+    }
+}
+
+// switch every zone off for the rest of the frame and reset the controllers
+void zonesOff(uint8_t reason){
+    for (uint8_t z = 0; z < HEATER_ZONES; z++){
+        zones[z].slots = 0;
+        zones[z].integral = 0;
+        setZoneHeater(z, false, reason, zones[z].temperature);
+    }
+}
+
+// PI step, sets the number of slots the zone asks for
+void updateZoneDuty(heaterZone *zone){
+    long error = zone->target * tempMultiplyFactor - zone->temperature;
+    long duty = error * ZONE_SLOTS / zoneBand + (zone->integral >> zoneIntegralShift);
+
+    // only integrate while the duty isn't pinned against a limit
+    if (duty > ZONE_SLOTS){
+        duty = ZONE_SLOTS;
+        if (error < 0) zone->integral += error;
+    } else if (duty < 0){
+        duty = 0;
+        if (error > 0) zone->integral += error;
+    } else {
+        zone->integral += error;
+    }
+    zone->duty = duty;
+}
+
+// true if adding current to the slots in mask keeps every slot in budget
+bool zoneFits(const uint16_t *load, uint16_t mask, uint16_t current){
+    for (uint8_t s = 0; s < ZONE_SLOTS; s++){
+        if ((mask & (1 << s)) && load[s] + current > zoneCurrentBudget){
+            return false;
+        }
+    }
+    return true;
+}
+
+// mask of duty slots in a row from start, wrapping round the end of the frame
+uint16_t zoneRun(uint8_t start, uint8_t duty){
+    uint16_t mask = 0;
+    for (uint8_t k = 0; k < duty; k++){
+        mask |= 1 << ((start + k) % ZONE_SLOTS);
+    }
+    return mask;
+}
+
+// slots where the mask switches on, i.e. the slot before is off (wrapping round)
+uint16_t zoneEdges(uint16_t mask){
+    uint16_t previous = ((mask << 1) | (mask >> (ZONE_SLOTS - 1))) & ((1 << ZONE_SLOTS) - 1);
+    return mask & ~previous;
+}
+
+/***
+ * Find a run of slots for a zone that keeps every slot in budget
+ * Input: load - current already drawn in each slot
+ *        starts - slots some zone already switches on in
+ *        offset - slot to start looking from
+ *        duty - length of the run
+ *        current - the zone's current
+ *        newStart - only use a start slot no other zone switches on in
+ * Output: the run's mask, 0 if none fits
+*/
+uint16_t zoneFindRun(const uint16_t *load, uint16_t starts, uint8_t offset, uint8_t duty, uint16_t current, bool newStart){
+    for (uint8_t s = 0; s < ZONE_SLOTS; s++){
+        uint8_t start = (offset + s) % ZONE_SLOTS;
+        if (newStart && (starts & (1 << start))) continue;
+        uint16_t run = zoneRun(start, duty);
+        if (zoneFits(load, run, current)){
+            return run;
+        }
+    }
+    return 0;
+}
+
+/***
+ * Place each zone's slots in the frame
+ * If every zone's duty could fit in the budget, the longest duties are placed
+ * first and each run carries on where the last one ended, which packs the
+ * frame without gaps, so zones with the same current always get their full
+ * duty. Otherwise the zone that gets first pick rotates every frame, so the
+ * shortfall is shared out between them, and each zone looks from its own
+ * staggered offset.
+ * A zone gets one run of slots, starting in a slot no other zone switches on
+ * in if it can. If no run fits it takes whatever single slots still have
+ * room, and gets fewer slots than it asked for if the budget is used up.
+*/
+void scheduleZones(){
+    static uint8_t firstZone = 0;
+    uint16_t load[ZONE_SLOTS] = {0};
+    uint16_t starts = 0; // slots where some zone switches on
+    uint8_t order[HEATER_ZONES];
+    uint32_t demand = 0;
+    bool packed = false;
+    uint8_t nextStart = 0; // where the last run ended, when packing
+
+    for (uint8_t i = 0; i < HEATER_ZONES; i++){
+        order[i] = (firstZone + i) % HEATER_ZONES;
+        demand += (uint32_t)zones[i].duty * zoneConfigs[i].current;
+    }
+    if (demand <= (uint32_t)zoneCurrentBudget * ZONE_SLOTS){
+        packed = true;
+        // insertion sort by duty, longest first, keeping the rotation for ties
+        for (uint8_t i = 1; i < HEATER_ZONES; i++){
+            uint8_t z = order[i];
+            uint8_t j = i;
+            for (; j > 0 && zones[order[j - 1]].duty < zones[z].duty; j--){
+                order[j] = order[j - 1];
+            }
+            order[j] = z;
+        }
+    }
+
+    for (uint8_t i = 0; i < HEATER_ZONES; i++){
+        uint8_t z = order[i];
+        heaterZone *zone = &zones[z];
+        uint16_t current = zoneConfigs[z].current;
+        uint8_t offset = packed ? nextStart : z * ZONE_SLOTS / HEATER_ZONES;
+        uint16_t mask = 0;
+
+        if (zone->duty >= ZONE_SLOTS){
+            // always on, there is no switch on edge to stagger
+            mask = zoneRun(0, ZONE_SLOTS);
+            if (!zoneFits(load, mask, current)) mask = 0;
+        } else if (zone->duty > 0){
+            mask = zoneFindRun(load, starts, offset, zone->duty, current, true);
+            if (!mask){
+                // sharing a switch on slot beats splitting the duty up
+                mask = zoneFindRun(load, starts, offset, zone->duty, current, false);
+            }
+            // the next run carries on from the end of this one
+            for (uint8_t s = 0; s < ZONE_SLOTS; s++){
+                if ((mask & (1 << s)) && !(mask & (1 << ((s + 1) % ZONE_SLOTS)))){
+                    nextStart = (s + 1) % ZONE_SLOTS;
+                }
+            }
+        }
+
+    uint8_t granted = 0;
+        if (mask){
+            granted = zone->duty;
+        } else {
+            for (uint8_t s = 0; s < ZONE_SLOTS && granted < zone->duty; s++){
+                uint8_t slot = (offset + s) % ZONE_SLOTS;
+                if (load[slot] + current <= zoneCurrentBudget){
+                    mask |= 1 << slot;
+                    granted++;
+                }
+            }
+        }
+
+        for (uint8_t s = 0; s < ZONE_SLOTS; s++){
+            if (mask & (1 << s)) load[s] += current;
+        }
+        starts |= zoneEdges(mask);
+        if (zone->duty != 0 && (zone->slots != mask || zone->granted != granted)){
+            trace(TRACE_ZONE, (z << 8) | zone->duty, granted);
+        }
+        zone->slots = mask;
+        zone->granted = granted;
+    }
+    firstZone = (firstZone + 1) % HEATER_ZONES;
+}
+
+// drive the zone outputs for the current slot, every switch is traced
+void applyZoneSlot(){
+    for (uint8_t z = 0; z < HEATER_ZONES; z++){
+        bool on = zones[z].slots & (1 << zoneSlot);
+        setZoneHeater(z, on, REASON_SCHEDULE, zones[z].temperature);
+    }
+}
+
+// move on to the next slot, returns true at the start of a new frame
+bool nextZoneSlot(){
+    zoneSlot++;
+    if (zoneSlot >= ZONE_SLOTS){
+        zoneSlot = 0;
+        return true;
+    }
+    applyZoneSlot();
+    return false;
+}
+
+/***
+ * Frame step, reads the zone sensors and schedules the next frame
+ * Input: tempAmbient - zone 0's temperature, already read by the main loop
+*/
+void updateZones(long tempAmbient){
+    zones[0].target = targetTemp;
+    for (uint8_t z = 0; z < HEATER_ZONES; z++){
+        zones[z].temperature = z == 0 ? tempAmbient : readTempPin(zoneConfigs[z].sensorPin, SENSOR_AMBIENT);
+        updateZoneDuty(&zones[z]);
+    }
+    scheduleZones();
+    applyZoneSlot();
+}
+
+void printZones(){
+    for (uint8_t z = 0; z < HEATER_ZONES; z++){
+        LineBuilder line;
+        line.text(F("Zone "));
+        line.number(z);
+        line.text(F(" Target: "));
+        line.number(zones[z].target);
+        line.text(F("C, Temp: "));
+        line.fixed(zones[z].temperature, tempFractionBits);
+        line.text(F("C, Duty: "));
+        line.number(zones[z].duty);
+        line.character('/');
+        line.number(ZONE_SLOTS);
+        line.text(F(", Granted: "));
+        line.number(zones[z].granted);
+        line.send();
+    }
+}
+
+#endif
@@ -0,0 +1,412 @@
+// Host side calibration fitter for the heater controller sensors.
+//
+// Build: g++ -std=c++17 -O2 -o calfit tools/calfit.cpp
+// Usage: calfit [options] points.csv
+//
+// points.csv holds logged readings, one per line, '#' starts a comment:
+//     <sensor (0|1)>, <reference temp C>, <raw ADC (the "ADC:" value from 'r')>
+//
+// For each sensor the NTC resistance is worked back out of the divider in
+// readTemp() (10K NTC, in parallel with rpar, below a 10K rtop, read against
+// the 1.1V reference), and Beta and Steinhart-Hart models are fitted to it by
+// least squares. The firmware interpolates between two calibration points, so
+// the fitted curve is then turned into the straight line that best matches it
+// over the logged temperature range, and that line is written out as
+//   - a serial script of 'c' commands followed by 's'
+//   - a 256 byte EEPROM image with the calibration and the CRC that
+//     checkEepromCrc() expects, for programming a batch of boards directly
+//
+// Options:
+//     --vcc <V>        divider supply (default 3.3)
+//     --vref <V>       ADC reference (default 1.1)
+//     --rtop <ohms>    resistor above the NTC (default 10000)
+//     --rpar <ohms>    resistor in parallel with the NTC, 0 for none (default 10000)
+//     --script <file>  write the serial command script
+//     --image <file>   write the EEPROM image
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// firmware constants, see calibration.h
+const int kSensorCount = 2;
+const int kTempMultiplyFactor = 8;
+const int kEepromSize = 256;
+const int kAdcMax = 1023;
+const double kKelvin = 273.15;
+
+struct Divider {
+    double vcc = 3.3;
+    double vref = 1.1;
+    double rtop = 10000;
+    double rpar = 10000;
+};
+
+struct Point {
+    double temp; // reference, C
+    int adc;
+};
+
+// matches struct calibrationData on the AVR: 16 bit ints, little endian, no padding
+struct Calibration {
+    int16_t tempLow;
+    int16_t tempHigh;
+    uint16_t adcLow;
+    uint16_t adcHigh;
+    int16_t offset;
+};
+
+const Calibration kDefaultCalibration = {
+    -6 * kTempMultiplyFactor, 110 * kTempMultiplyFactor, 1023, 164, 0};
+
+// model: 1/T = a + b ln(R) + c ln(R)^3, c is 0 for the Beta model
+struct Model {
+    double a = 0, b = 0, c = 0;
+    bool valid = false;
+
+    double temperature(double resistance) const {
+        double l = std::log(resistance);
+        return 1.0 / (a + b * l + c * l * l * l) - kKelvin;
+    }
+};
+
+bool ntcResistance(const Divider &divider, int adc, double *resistance) {
+    if (adc <= 0 || adc >= kAdcMax) {
+        return false; // saturated, the resistance can't be recovered
+    }
+    double v = adc / 1024.0 * divider.vref / divider.vcc;
+    if (v >= 1.0) {
+        return false;
+    }
+    double bottom = divider.rtop * v / (1.0 - v);
+    if (divider.rpar > 0) {
+        if (bottom >= divider.rpar) {
+            return false;
+        }
+        bottom = 1.0 / (1.0 / bottom - 1.0 / divider.rpar);
+    }
+    *resistance = bottom;
+    return true;
+}
+
+// least squares fit of y = sum(coef[j] * x[j]) by the normal equations
+bool leastSquares(const std::vector<std::vector<long double>> &x,
+                  const std::vector<long double> &y, int terms, long double *coef) {
+    long double m[3][4] = {};
+    for (size_t i = 0; i < y.size(); i++) {
+        for (int r = 0; r < terms; r++) {
+            for (int c = 0; c < terms; c++) {
+                m[r][c] += x[i][r] * x[i][c];
+            }
+            m[r][terms] += x[i][r] * y[i];
+        }
+    }
+    // gaussian elimination with partial pivoting
+    for (int col = 0; col < terms; col++) {
+        int pivot = col;
+        for (int r = col + 1; r < terms; r++) {
+            if (std::fabs(m[r][col]) > std::fabs(m[pivot][col])) {
+                pivot = r;
+            }
+        }
+        if (std::fabs(m[pivot][col]) < 1e-30L) {
+            return false;
+        }
+        for (int c = 0; c <= terms; c++) {
+            std::swap(m[col][c], m[pivot][c]);
+        }
+        for (int r = 0; r < terms; r++) {
+            if (r == col) continue;
+            long double f = m[r][col] / m[col][col];
+            for (int c = col; c <= terms; c++) {
+                m[r][c] -= f * m[col][c];
+            }
+        }
+    }
+    for (int r = 0; r < terms; r++) {
+        coef[r] = m[r][terms] / m[r][r];
+    }
+    return true;
+}
+
+Model fitModel(const std::vector<double> &resistance, const std::vector<Point> &points,
+               bool steinhartHart) {
+    int terms = steinhartHart ? 3 : 2;
+    std::vector<std::vector<long double>> x;
+    std::vector<long double> y;
+    for (size_t i = 0; i < points.size(); i++) {
+        long double l = std::log(static_cast<long double>(resistance[i]));
+        x.push_back({1.0L, l, l * l * l});
+        y.push_back(1.0L / (points[i].temp + kKelvin));
+    }
+    long double coef[3] = {};
+    Model model;
+    if (!leastSquares(x, y, terms, coef)) {
+        return model;
+    }
+    model.a = static_cast<double>(coef[0]);
+    model.b = static_cast<double>(coef[1]);
+    model.c = steinhartHart ? static_cast<double>(coef[2]) : 0;
+    model.valid = true;
+    return model;
+}
+
+// the firmware's integer interpolation from readTemp(), in 1/8 C
+long firmwareTemp(const Calibration &cal, int adc) {
+    long adcOffset = adc - static_cast<long>(cal.adcLow);
+    long tempRange = static_cast<long>(cal.tempLow) - cal.tempHigh;
+    long adcRange = static_cast<long>(cal.adcLow) - cal.adcHigh;
+    return (adcOffset * tempRange) / adcRange + (cal.tempLow + cal.offset);
+}
+
+/***
+ * Turn a fitted model into the firmware's two point calibration
+ * The best straight line temp = slope * adc + intercept through the model,
+ * sampled over the logged range, is pinned at two whole degree points. The
+ * 'c' command reads the temperature as two characters, so the low point is
+ * kept within 10-29C and the high point within 30-99C.
+*/
+bool linearise(const Model &model, const Divider &divider, double low, double high,
+               Calibration *cal) {
+    std::vector<std::vector<long double>> x;
+    std::vector<long double> y;
+    for (int adc = 1; adc < kAdcMax; adc++) {
+        double r;
+        if (!ntcResistance(divider, adc, &r)) continue;
+        double t = model.temperature(r);
+        if (t < low || t > high) continue;
+        x.push_back({1.0L, static_cast<long double>(adc), 0.0L});
+        y.push_back(t);
+    }
+    long double coef[3];
+    if (y.size() < 2 || !leastSquares(x, y, 2, coef) || coef[1] == 0) {
+        return false;
+    }
+    double intercept = static_cast<double>(coef[0]);
+    double slope = static_cast<double>(coef[1]);
+
+    int tempLow = std::clamp(static_cast<int>(std::floor(low)), 10, 29);
+    int tempHigh = std::clamp(static_cast<int>(std::ceil(high)), 30, 99);
+    int adcLow = static_cast<int>(std::lround((tempLow - intercept) / slope));
+    int adcHigh = static_cast<int>(std::lround((tempHigh - intercept) / slope));
+    if (adcLow < 0 || adcLow > kAdcMax || adcHigh < 0 || adcHigh > kAdcMax || adcLow == adcHigh) {
+        return false;
+    }
+    cal->tempLow = static_cast<int16_t>(tempLow * kTempMultiplyFactor);
+    cal->tempHigh = static_cast<int16_t>(tempHigh * kTempMultiplyFactor);
+    cal->adcLow = static_cast<uint16_t>(adcLow);
+    cal->adcHigh = static_cast<uint16_t>(adcHigh);
+    cal->offset = 0;
+    return true;
+}
+
+// eeprom_crc() from calibration.h, including its per byte inversion
+uint32_t eepromCrc(const uint8_t *eeprom) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    uint32_t crc = 0xFFFFFFFFu; // ~0L on the AVR
+    for (int i = 0; i < kEepromSize - 4; i++) {
+        crc = table[(crc ^ eeprom[i]) & 0x0f] ^ (crc >> 4);
+        crc = table[(crc ^ (eeprom[i] >> 4)) & 0x0f] ^ (crc >> 4);
+        crc = ~crc;
+    }
+    return crc;
+}
+
+void put16(uint8_t *p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+// image as writeCal() leaves it after a wipe: calibration, zeros (so the
+// energy meter starts from 0), CRC
+void buildImage(const Calibration *cal, uint8_t *eeprom) {
+    std::memset(eeprom, 0, kEepromSize);
+    for (int s = 0; s < kSensorCount; s++) {
+        uint8_t *p = eeprom + s * 10;
+        put16(p, cal[s].tempLow);
+        put16(p + 2, cal[s].tempHigh);
+        put16(p + 4, cal[s].adcLow);
+        put16(p + 6, cal[s].adcHigh);
+        put16(p + 8, cal[s].offset);
+    }
+    uint32_t crc = eepromCrc(eeprom);
+    for (int i = 0; i < 4; i++) {
+        eeprom[kEepromSize - 4 + i] = (crc >> (8 * i)) & 0xFF;
+    }
+}
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: calfit [--vcc V] [--vref V] [--rtop ohms] [--rpar ohms]\n"
+                 "              [--script file] [--image file] points.csv\n");
+    std::exit(2);
+}
+
+void printResiduals(const char *name, const std::vector<double> &errors) {
+    double sum = 0, worst = 0;
+    for (double e : errors) {
+        sum += e * e;
+        worst = std::max(worst, std::fabs(e));
+    }
+    std::printf("  %-22s rms %.3fC, max %.3fC\n", name, std::sqrt(sum / errors.size()), worst);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Divider divider;
+    std::string input, scriptFile, imageFile;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--vcc" && hasValue) divider.vcc = std::atof(argv[++i]);
+        else if (arg == "--vref" && hasValue) divider.vref = std::atof(argv[++i]);
+        else if (arg == "--rtop" && hasValue) divider.rtop = std::atof(argv[++i]);
+        else if (arg == "--rpar" && hasValue) divider.rpar = std::atof(argv[++i]);
+        else if (arg == "--script" && hasValue) scriptFile = argv[++i];
+        else if (arg == "--image" && hasValue) imageFile = argv[++i];
+        else if (arg[0] != '-' && input.empty()) input = arg;
+        else usage();
+    }
+    if (input.empty()) usage();
+
+    std::ifstream file(input);
+    if (!file) {
+        std::fprintf(stderr, "calfit: can't open %s\n", input.c_str());
+        return 1;
+    }
+
+    std::vector<Point> points[kSensorCount];
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream fields(line);
+        int sensor, adc;
+        double temp;
+        if (!(fields >> sensor)) continue; // blank line
+        if (!(fields >> temp >> adc) || sensor < 0 || sensor >= kSensorCount) {
+            std::fprintf(stderr, "calfit: %s:%d: expected <sensor>, <temp>, <adc>\n",
+                         input.c_str(), lineNumber);
+            return 1;
+        }
+        points[sensor].push_back({temp, adc});
+    }
+
+    Calibration cal[kSensorCount] = {kDefaultCalibration, kDefaultCalibration};
+    bool fitted[kSensorCount] = {};
+    for (int s = 0; s < kSensorCount; s++) {
+        std::printf("Sensor %d (%s): ", s, s == 0 ? "ambient" : "heater");
+        std::vector<Point> used;
+        std::vector<double> resistance;
+        for (const Point &p : points[s]) {
+            double r;
+            if (ntcResistance(divider, p.adc, &r)) {
+                used.push_back(p);
+                resistance.push_back(r);
+            }
+        }
+        std::printf("%zu points", used.size());
+        if (used.size() != points[s].size()) {
+            std::printf(" (%zu saturated, ignored)", points[s].size() - used.size());
+        }
+        std::printf("\n");
+        if (used.size() < 2) {
+            std::printf("  not enough points, keeping the default calibration\n");
+            continue;
+        }
+
+        Model beta = fitModel(resistance, used, false);
+        Model steinhartHart;
+        if (used.size() >= 3) {
+            steinhartHart = fitModel(resistance, used, true);
+        }
+        if (beta.valid) {
+            // 1/T = 1/T0 + ln(R/R0)/beta, quoted at 25C
+            double r25 = std::exp((1.0 / (25 + kKelvin) - beta.a) / beta.b);
+            std::printf("  Beta: %.1f, R25 %.0f ohms\n", 1.0 / beta.b, r25);
+        }
+        if (steinhartHart.valid) {
+            std::printf("  Steinhart-Hart: A %.6e, B %.6e, C %.6e\n",
+                        steinhartHart.a, steinhartHart.b, steinhartHart.c);
+        }
+
+        // with three points Steinhart-Hart fits exactly, so only trust it with more
+        const Model &model = used.size() >= 4 && steinhartHart.valid ? steinhartHart : beta;
+        if (!model.valid) {
+            std::printf("  fit failed, keeping the default calibration\n");
+            continue;
+        }
+
+        double low = used[0].temp, high = used[0].temp;
+        for (const Point &p : used) {
+            low = std::min(low, p.temp);
+            high = std::max(high, p.temp);
+        }
+        if (!linearise(model, divider, low, high, &cal[s])) {
+            std::printf("  couldn't fit calibration points in range, keeping the default\n");
+            continue;
+        }
+        fitted[s] = true;
+
+        std::vector<double> betaErrors, shErrors, firmwareErrors;
+        for (size_t i = 0; i < used.size(); i++) {
+            if (beta.valid) betaErrors.push_back(beta.temperature(resistance[i]) - used[i].temp);
+            if (steinhartHart.valid) {
+                shErrors.push_back(steinhartHart.temperature(resistance[i]) - used[i].temp);
+            }
+            firmwareErrors.push_back(firmwareTemp(cal[s], used[i].adc) /
+                                         static_cast<double>(kTempMultiplyFactor) - used[i].temp);
+        }
+        std::printf("  Residuals over %.1f - %.1fC:\n", low, high);
+        if (!betaErrors.empty()) printResiduals("Beta", betaErrors);
+        if (!shErrors.empty()) printResiduals("Steinhart-Hart", shErrors);
+        printResiduals("firmware (two point)", firmwareErrors);
+        std::printf("  Calibration: %dC @ ADC %u, %dC @ ADC %u\n",
+                    cal[s].tempLow / kTempMultiplyFactor, cal[s].adcLow,
+                    cal[s].tempHigh / kTempMultiplyFactor, cal[s].adcHigh);
+    }
+
+    if (!scriptFile.empty()) {
+        std::FILE *script = std::fopen(scriptFile.c_str(), "w");
+        if (!script) {
+            std::fprintf(stderr, "calfit: can't write %s\n", scriptFile.c_str());
+            return 1;
+        }
+        for (int s = 0; s < kSensorCount; s++) {
+            if (!fitted[s]) continue;
+            std::fprintf(script, "c %d %d %u\n", s, cal[s].tempLow / kTempMultiplyFactor, cal[s].adcLow);
+            std::fprintf(script, "c %d %d %u\n", s, cal[s].tempHigh / kTempMultiplyFactor, cal[s].adcHigh);
+        }
+        std::fprintf(script, "s\n");
+        std::fclose(script);
+        std::printf("Serial script written to %s\n", scriptFile.c_str());
+    }
+
+    if (!imageFile.empty()) {
+        uint8_t eeprom[kEepromSize];
+        buildImage(cal, eeprom);
+        std::ofstream image(imageFile, std::ios::binary);
+        if (!image.write(reinterpret_cast<const char *>(eeprom), kEepromSize)) {
+            std::fprintf(stderr, "calfit: can't write %s\n", imageFile.c_str());
+            return 1;
+        }
+        std::printf("EEPROM image written to %s (%d bytes)\n", imageFile.c_str(), kEepromSize);
+    }
+    return 0;
+}
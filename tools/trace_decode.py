@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""Decode an event trace dumped by the heater's 'd' command.
+
+Usage: trace_decode.py [capture.txt]   (reads stdin without a file)
+
+Feed it the serial output, only the "T <hex>" lines are used. Event and
+reason names mirror the enums in src/trace.h.
+
+Events only carry the low 16 bits of millis(), so times are rebuilt from the
+gaps between events. The firmware records a HEARTBEAT after 30 seconds with
+no other event, so no gap is long enough to wrap, and the HEARTBEAT holds the
+high 16 bits of millis(), which puts the timeline back on the exact time.
+Times are in seconds since the last reset, since millis() restarts there.
+"""
+import struct
+import sys
+
+TEMP_MULTIPLY_FACTOR = 8  # tempMultiplyFactor in src/calibration.h
+
+EVENTS = {
+    1: "RESET",
+    2: "SAMPLE",
+    3: "HEATER_ON",
+    4: "HEATER_OFF",
+    5: "COMMAND",
+    6: "TARGET",
+    7: "CALIBRATION",
+    8: "EEPROM_WRITE",
+    9: "SETPOINT",
+    10: "FAULT",
+    11: "ZONE",
+    12: "REGISTER",
+    13: "HEARTBEAT",
+}
+
+REASONS = ["startup", "stopped", "heater limit", "hysteresis", "cascade", "watchdog", "diagnostic",
+           "schedule"]
+
+# uint16 time, uint8 id, int16 a, int16 b, little endian and unpadded as on the AVR
+EVENT_FORMAT = "<HBhh"
+EVENT_SIZE = struct.calcsize(EVENT_FORMAT)
+
+
+def temp(value):
+    return "%.3fC" % (value / TEMP_MULTIPLY_FACTOR)
+
+
+def reason(value):
+    return REASONS[value] if 0 <= value < len(REASONS) else "reason %d" % value
+
+
+def describe(event_id, a, b):
+    name = EVENTS.get(event_id, "UNKNOWN(%d)" % event_id)
+    if event_id == 1:
+        return name, "flags=0x%02X warm=%d" % (a & 0xFF, b)
+    if event_id == 2:
+        return name, "ambient=%s heater=%s" % (temp(a), temp(b))
+    if event_id in (3, 4):
+        return name, "zone=%d %s at %s" % ((a >> 8) & 0xFF, reason(a & 0xFF), temp(b))
+    if event_id == 5:
+        return name, "'%s' length=%d" % (chr(a & 0xFF), b)
+    if event_id == 6:
+        return name, "%dC zone=%d" % (a, b)
+    if event_id == 7:
+        return name, "sensor=%d field=%s value=%d" % ((a >> 8) & 0xFF, chr(a & 0xFF), b)
+    if event_id == 8:
+        return name, {0: "calibration", 1: "wipe", 2: "energy meter"}.get(a, str(a))
+    if event_id == 9:
+        return name, "setpoint=%s integral=%d" % (temp(a), b)
+    if event_id == 10:
+        return name, "%s value=%d" % (reason(a), b)
+    if event_id == 11:
+        return name, "zone=%d duty=%d granted=%d" % ((a >> 8) & 0xFF, a & 0xFF, b)
+    if event_id == 13:
+        return name, ""
+    if event_id == 12:
+        return name, "function=0x%02X exception=%d register=%d" % ((a >> 8) & 0xFF, a & 0xFF, b)
+    return name, "a=%d b=%d" % (a, b)
+
+
+def decode(lines):
+    events = []
+    for line in lines:
+        line = line.strip()
+        if not line.startswith("T "):
+            continue
+        data = bytes.fromhex(line[2:])
+        if len(data) < EVENT_SIZE:
+            continue
+        events.append(struct.unpack(EVENT_FORMAT, data[:EVENT_SIZE]))
+
+    # the timestamps are the low 16 bits of millis(), the heartbeats keep
+    # every gap under 65 seconds so they unwrap exactly
+    elapsed = 0
+    previous = None
+    for time, event_id, a, b in events:
+        if event_id == 1:
+            # millis() counts from the reset
+            elapsed = time
+        elif event_id == 13:
+            elapsed = ((a & 0xFFFF) << 16) | time
+        elif previous is not None:
+            elapsed += (time - previous) & 0xFFFF
+        previous = time
+        name, detail = describe(event_id, a, b)
+        print("%10.3f  %-12s %s" % (elapsed / 1000.0, name, detail))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) > 1:
+        with open(sys.argv[1]) as capture:
+            decode(capture)
+    else:
+        decode(sys.stdin)